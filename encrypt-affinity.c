@@ -0,0 +1,200 @@
+#define _GNU_SOURCE // cpu_set_t, sched_getcpu(), pthread_attr_setaffinity_np()
+#include "encrypt-affinity.h"
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// nodes looked for in sysfs
+#define AFFINITY_MAX_NODES 64
+
+// CPUs in the order the stages take them
+static int order[CPU_SETSIZE];
+static int order_count = 0;
+// first CPU of each core in order, when siblings follow each other
+static char core_start[CPU_SETSIZE];
+
+// planned CPU of each stage, workers have one each
+static int stage_cpus[AFFINITY_WRITER + 1];
+static int* worker_cpus = NULL;
+static int worker_count = 0;
+static int fused_plan = 0;
+
+// reads a CPU list like "0-3,8" into set, returns 0 if it is not one
+static int parse_cpulist(const char *text, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = text;
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) {
+            return 0;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return 0;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p && *p != '\n') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int read_cpulist(const char *path, cpu_set_t *set) {
+    char text[4096];
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    int ok = fgets(text, sizeof(text), f) != NULL && parse_cpulist(text, set);
+    fclose(f);
+    return ok;
+}
+
+static int read_cpu_list(int cpu, const char *file, cpu_set_t *set) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, file);
+    return read_cpulist(path, set);
+}
+
+// appends the CPUs of pass not planned yet, each followed by its SMT siblings
+static void add_cores(cpu_set_t *pass, cpu_set_t *placed) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, pass) || CPU_ISSET(cpu, placed)) {
+            continue;
+        }
+        cpu_set_t siblings;
+        if (!read_cpu_list(cpu, "topology/thread_siblings_list", &siblings)) {
+            CPU_ZERO(&siblings);
+        }
+        CPU_SET(cpu, &siblings);
+        core_start[order_count] = 1;
+        for (int s = cpu; s < CPU_SETSIZE; s++) {
+            if (CPU_ISSET(s, &siblings) && CPU_ISSET(s, pass) && !CPU_ISSET(s, placed)) {
+                CPU_SET(s, placed);
+                order[order_count++] = s;
+            }
+        }
+    }
+}
+
+// orders the CPUs this process may use, the caller's L3 first
+static void order_auto(cpu_set_t *allowed) {
+    cpu_set_t near, pass, placed;
+    CPU_ZERO(&placed);
+    int here = sched_getcpu();
+    if (here < 0 || !read_cpu_list(here, "cache/index3/shared_cpu_list", &near)) {
+        near = *allowed;
+    }
+    CPU_AND(&pass, &near, allowed);
+    add_cores(&pass, &placed);
+    add_cores(allowed, &placed);
+}
+
+int affinity_plan(const char *cpus, int workers, int fused) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return 0;
+    }
+    order_count = 0;
+    memset(core_start, 0, sizeof(core_start));
+    int automatic = strcmp(cpus, "auto") == 0;
+    if (automatic) {
+        order_auto(&allowed);
+    } else {
+        // the CPUs as listed, one per stage
+        cpu_set_t listed;
+        if (!parse_cpulist(cpus, &listed)) {
+            return 0;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &listed) && CPU_ISSET(cpu, &allowed)) {
+                order[order_count++] = cpu;
+            }
+        }
+    }
+    if (order_count == 0) {
+        return 0;
+    }
+
+    free(worker_cpus);
+    worker_cpus = malloc(sizeof(int) * workers);
+    worker_count = workers;
+    fused_plan = fused;
+    int next = 0;
+    stage_cpus[AFFINITY_READER] = order[next++ % order_count];
+    if (!fused) {
+        stage_cpus[AFFINITY_INPUT_COUNTER] = order[next++ % order_count];
+    }
+    for (int i = 0; i < workers; i++) {
+        worker_cpus[i] = order[next++ % order_count];
+    }
+    // the output counter and writer share a core of their own
+    while (automatic && !fused && next < order_count && !core_start[next]) {
+        next++;
+    }
+    if (!fused) {
+        stage_cpus[AFFINITY_OUTPUT_COUNTER] = order[next++ % order_count];
+    }
+    stage_cpus[AFFINITY_WRITER] = order[next++ % order_count];
+    return 1;
+}
+
+static int planned_cpu(enum affinity_role role, int index) {
+    return role == AFFINITY_WORKER ? worker_cpus[index % worker_count] : stage_cpus[role];
+}
+
+void affinity_attr(pthread_attr_t *attr, enum affinity_role role, int index) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(planned_cpu(role, index), &set);
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int affinity_node(enum affinity_role role, int index) {
+    int cpu = planned_cpu(role, index);
+    for (int node = 0; node < AFFINITY_MAX_NODES; node++) {
+        char path[128];
+        cpu_set_t set;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_cpulist(path, &set) && CPU_ISSET(cpu, &set)) {
+            return node;
+        }
+    }
+    return 0;
+}
+
+void affinity_bind(void *memory, size_t size, int node) {
+    // a kernel without NUMA support leaves the pages wherever they land
+    unsigned long mask[AFFINITY_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(__NR_mbind, memory, size, MPOL_PREFERRED, mask, AFFINITY_MAX_NODES + 1, 0);
+}
+
+void affinity_print(FILE *out) {
+    fprintf(out, "\nPlacement: reader %d", stage_cpus[AFFINITY_READER]);
+    if (!fused_plan) {
+        fprintf(out, ", input counter %d", stage_cpus[AFFINITY_INPUT_COUNTER]);
+    }
+    fprintf(out, ", %s", fused_plan ? "fused workers" : "encryptors");
+    for (int i = 0; i < worker_count; i++) {
+        fprintf(out, " %d", worker_cpus[i]);
+    }
+    if (!fused_plan) {
+        fprintf(out, ", output counter %d", stage_cpus[AFFINITY_OUTPUT_COUNTER]);
+    }
+    fprintf(out, ", writer %d (node %d input, node %d output)\n", stage_cpus[AFFINITY_WRITER],
+            affinity_node(AFFINITY_WORKER, 0), affinity_node(AFFINITY_WRITER, 0));
+}
@@ -0,0 +1,47 @@
+#ifndef ENCRYPT_AFFINITY_H
+#define ENCRYPT_AFFINITY_H
+
+/* Placement of the pipeline threads on CPUs and of the buffers on NUMA nodes
+ * (-c). The topology comes from sysfs and the memory policy from the mbind
+ * system call, so nothing beyond the C library is linked in.
+ *
+ * A plan hands CPUs to the stages in pipeline order: reader, input counter,
+ * workers, output counter, writer (reader, workers, writer when fused). Given
+ * a CPU list they get its CPUs in that order. Planned automatically, the CPUs
+ * sharing the caller's L3 come first and SMT siblings follow each other, so
+ * the reader and input counter share a core, as do the output counter and
+ * writer. With more threads than CPUs the plan wraps around.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+enum affinity_role {
+    AFFINITY_READER,
+    AFFINITY_INPUT_COUNTER,
+    AFFINITY_WORKER,       // one CPU per worker, told apart by index
+    AFFINITY_OUTPUT_COUNTER,
+    AFFINITY_WRITER,
+};
+
+/* Plans where the threads go, cpus is "auto" or a list like "0-3,8". Returns
+ * 0 if the list is not valid or holds no CPU this process may run on.
+ */
+int affinity_plan(const char *cpus, int workers, int fused);
+
+/* Sets attr to start a thread on the CPU planned for the role. */
+void affinity_attr(pthread_attr_t *attr, enum affinity_role role, int index);
+
+/* NUMA node of the CPU planned for the role, 0 where that is unknown. */
+int affinity_node(enum affinity_role role, int index);
+
+/* Places the pages of memory, not faulted in yet, on node when they are
+ * first touched, falling back to other nodes when it is full.
+ */
+void affinity_bind(void *memory, size_t size, int node);
+
+/* Prints the CPU of every stage on one line. */
+void affinity_print(FILE *out);
+
+#endif // ENCRYPT_AFFINITY_H
@@ -0,0 +1,90 @@
+#include "encrypt-arena.h"
+#include "encrypt-affinity.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ARENA_ALIGN 64
+
+static size_t round_up(size_t size, size_t to) {
+    return (size + to - 1) / to * to;
+}
+
+// reserves address space only, with one huge page to spare for aligning the start
+static int reserve(struct arena *a) {
+    size_t size = ARENA_RESERVE + ARENA_HUGE_PAGE;
+    char *range = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (range == MAP_FAILED) {
+        return 0;
+    }
+    a->base = (char *)round_up((uintptr_t)range, ARENA_HUGE_PAGE);
+    // the unaligned ends are never used
+    if (a->base > range) {
+        munmap(range, a->base - range);
+    }
+    munmap(a->base + ARENA_RESERVE, range + size - (a->base + ARENA_RESERVE));
+    return 1;
+}
+
+// backs the reserved range up to end with memory, on node when it is 0 or above
+static int commit(struct arena *a, size_t end, int node) {
+    size_t length = round_up(end, ARENA_HUGE_PAGE) - a->committed;
+    if (length == 0) {
+        return 1;
+    }
+    char *start = a->base + a->committed;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+    // pooled pages are placed by the policy in force when they are faulted, so
+    // they are only taken where no node is asked for
+    if (node < 0 && mmap(start, length, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | MAP_POPULATE, -1, 0) != MAP_FAILED) {
+        a->pooled += length;
+    } else {
+        if (mmap(start, length, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED) {
+            return 0;
+        }
+        madvise(start, length, MADV_HUGEPAGE);
+        if (node >= 0) {
+            affinity_bind(start, length, node);
+        }
+        // faults every page in now instead of on the pipeline's first pass
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; i < length; i += page) {
+            ((volatile char *)start)[i] = 0;
+        }
+    }
+    a->committed += length;
+    return 1;
+}
+
+void arena_init(struct arena *a) {
+    a->base = NULL;
+    a->used = a->committed = a->pooled = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size, int node) {
+    if (!a->base && !reserve(a)) {
+        return NULL;
+    }
+    // bytes for a node start past everything committed, so the policy covers all their pages
+    size_t start = node >= 0 ? a->committed : round_up(a->used, ARENA_ALIGN);
+    if (size > ARENA_RESERVE - start) {
+        return NULL;
+    }
+    if (!commit(a, start + size, node)) {
+        return NULL;
+    }
+    a->used = start + size;
+    return a->base + start;
+}
+
+void arena_destroy(struct arena *a) {
+    if (a->base) {
+        munmap(a->base, ARENA_RESERVE);
+    }
+    arena_init(a);
+}
+
+void arena_print(struct arena *a, FILE *out) {
+    fprintf(out, "arena: %.1f MB committed, %.1f MB from the huge page pool\n", a->committed / 1048576.0,
+            a->pooled / 1048576.0);
+}
@@ -0,0 +1,44 @@
+#ifndef ENCRYPT_ARENA_H
+#define ENCRYPT_ARENA_H
+
+/* An arena per pipeline for its buffer slots, per-slot block descriptors and
+ * epoch count sets, so the pipeline makes no allocations once it runs. The
+ * address range is reserved on first use and committed in 2 MB pieces as it
+ * is handed out: from the huge page pool when it has pages free, otherwise as
+ * normal pages advised for transparent huge pages. Committed memory is
+ * faulted in right away. Allocation is meant for startup and not thread safe,
+ * nothing is given back before arena_destroy().
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+// address space reserved, the most the arena can hand out
+#define ARENA_RESERVE (64ULL << 30)
+
+// size of a huge page, and of the pieces the arena is committed in
+#define ARENA_HUGE_PAGE (2 << 20)
+
+struct arena {
+    char *base;       // start of the reserved range, on a huge page boundary
+    size_t used;      // bytes handed out
+    size_t committed; // bytes backed by memory
+    size_t pooled;    // bytes of those from the huge page pool
+};
+
+/* An empty arena, nothing is reserved before the first allocation. */
+void arena_init(struct arena *a);
+
+/* Returns size zeroed bytes aligned to a cache line, or NULL when the arena
+ * is full. With node 0 or above the bytes start a huge page of their own and
+ * are placed on that NUMA node.
+ */
+void *arena_alloc(struct arena *a, size_t size, int node);
+
+/* Unmaps the arena and everything handed out from it. */
+void arena_destroy(struct arena *a);
+
+/* Prints how much is committed and how much of it came from the huge page pool. */
+void arena_print(struct arena *a, FILE *out);
+
+#endif // ENCRYPT_ARENA_H
@@ -0,0 +1,77 @@
+#include "encrypt-bench.h"
+#include <time.h>
+
+// 16 buckets of 1 ns, then 16 per power of two up to 2^63 ns
+#define LATENCY_STEPS 16
+#define LATENCY_BUCKETS (LATENCY_STEPS + 60 * LATENCY_STEPS)
+
+static long long latencies[LATENCY_BUCKETS];
+static long long blocks = 0, bytes = 0;
+static long long started = 0, stopped = 0;
+static long long resets = 0, reset_time = 0, reset_started = 0;
+
+long long bench_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+void bench_start() {
+    started = bench_now();
+}
+
+void bench_stop() {
+    stopped = bench_now();
+}
+
+static int bucket(long long ns) {
+    if (ns < LATENCY_STEPS) {
+        return ns < 0 ? 0 : ns;
+    }
+    int e = 63 - __builtin_clzll(ns); // at least 4
+    return LATENCY_STEPS + (e - 4) * LATENCY_STEPS + (int)((ns >> (e - 4)) - LATENCY_STEPS);
+}
+
+// largest latency that falls into bucket b
+static long long bucket_limit(int b) {
+    if (b < LATENCY_STEPS) {
+        return b;
+    }
+    int e = (b - LATENCY_STEPS) / LATENCY_STEPS + 4;
+    long long step = (b - LATENCY_STEPS) % LATENCY_STEPS;
+    return ((LATENCY_STEPS + step + 1) << (e - 4)) - 1;
+}
+
+void bench_block_written(long long read_time, size_t len) {
+    latencies[bucket(bench_now() - read_time)]++;
+    blocks++;
+    bytes += len;
+}
+
+void bench_reset_begin() {
+    reset_started = bench_now();
+}
+
+void bench_reset_end() {
+    reset_time += bench_now() - reset_started;
+    resets++;
+}
+
+// latency in microseconds that a fraction q of all blocks stayed within
+static double percentile(double q) {
+    long long seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += latencies[b];
+        if (seen > 0 && seen >= q * blocks) {
+            return bucket_limit(b) / 1e3;
+        }
+    }
+    return 0;
+}
+
+void bench_report(FILE *out) {
+    double seconds = (stopped - started) / 1e9;
+    fprintf(out, "bench bytes=%lld seconds=%.6f mb_per_s=%.2f blocks=%lld p50_us=%.3f p99_us=%.3f resets=%lld reset_us=%.3f\n",
+            bytes, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0, blocks, percentile(0.5), percentile(0.99),
+            resets, resets > 0 ? reset_time / 1e3 / resets : 0);
+}
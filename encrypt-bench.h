@@ -0,0 +1,35 @@
+#ifndef ENCRYPT_BENCH_H
+#define ENCRYPT_BENCH_H
+
+/* Timing for benchmark builds. The driver only calls these when built with
+ * -DENCRYPT_BENCH (make bench builds encrypt-bench-semaphore and
+ * encrypt-bench-lockfree), release builds carry no timing at all. Each
+ * function is called by one thread only, as noted, so nothing is shared.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Monotonic clock in nanoseconds. */
+long long bench_now();
+
+/* Main thread: brackets the run of the pipeline threads. */
+void bench_start();
+void bench_stop();
+
+/* Writer: a block of len characters read at read_time has been handed to the
+ * output file. Latencies go into a log-linear histogram with 16 steps per
+ * power of two.
+ */
+void bench_block_written(long long read_time, size_t len);
+
+/* Reader: brackets a reset, see reset_requested() and reset_finished(). */
+void bench_reset_begin();
+void bench_reset_end();
+
+/* Prints one line of key=value pairs: bytes, seconds, MB/s, blocks, p50 and
+ * p99 block latency and the mean reset cost in microseconds.
+ */
+void bench_report(FILE *out);
+
+#endif // ENCRYPT_BENCH_H
@@ -0,0 +1,110 @@
+#!/bin/sh
+# End to end benchmark, run by make bench. Generates text and binary inputs, runs the
+# timed builds over every combination of the settings below and writes one row per run
+# to bench.csv and bench.json. Each setting is a space separated list from the environment:
+#
+#   BENCH_SIZES    input sizes as head -c takes them          (default "1M 16M", up to e.g. 10G)
+#   BENCH_KINDS    text and/or binary                         (default "text binary")
+#   BENCH_SLOTS    input and output buffer slots, -n and -m   (default "4 64")
+#   BENCH_BLOCKS   block sizes, a block never crosses a reset (default "16 200")
+#   BENCH_WORKERS  encryptor threads, -w                      (default "1 4")
+#   BENCH_RINGS    semaphore and/or lockfree                  (default "semaphore lockfree")
+#   BENCH_ENGINES  cipher engines, -e                         (default "shift caesar aes chacha")
+#   BENCH_FLAGS    extra flags for every run, such as -f or -u 32
+#   BENCH_DIR      where inputs and outputs go                (default $TMPDIR/encrypt-bench)
+#   BENCH_CSV, BENCH_JSON  result files                       (default bench.csv, bench.json)
+#
+# Latencies are per block, from the reader handing it on to the writer handing it to the
+# kernel. reset_us is the mean time the reader spends in a reset.
+set -e
+
+SIZES=${BENCH_SIZES:-"1M 16M"}
+KINDS=${BENCH_KINDS:-"text binary"}
+SLOTS=${BENCH_SLOTS:-"4 64"}
+BLOCKS=${BENCH_BLOCKS:-"16 200"}
+WORKERS=${BENCH_WORKERS:-"1 4"}
+RINGS=${BENCH_RINGS:-"semaphore lockfree"}
+ENGINES=${BENCH_ENGINES:-"shift caesar aes chacha"}
+FLAGS=${BENCH_FLAGS:-}
+DIR=${BENCH_DIR:-${TMPDIR:-/tmp}/encrypt-bench}
+CSV=${BENCH_CSV:-bench.csv}
+JSON=${BENCH_JSON:-bench.json}
+
+# the stream cipher engines need a secret, a fixed one keeps runs comparable
+ENCRYPT_KEY=${ENCRYPT_KEY:-000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f}
+export ENCRYPT_KEY
+
+REV=$(git describe --always --dirty 2>/dev/null || echo unknown)
+FLAGS_FIELD="\"$(printf '%s' "$FLAGS" | sed 's/"/""/g')\""
+mkdir -p "$DIR"
+
+# generated once per kind and size and kept in BENCH_DIR for later runs
+input() {
+    file="$DIR/$1-$2"
+    if [ ! -f "$file" ]; then
+        if [ "$1" = text ]; then
+            base64 -w 76 /dev/urandom | head -c "$2" > "$file"
+        else
+            head -c "$2" /dev/urandom > "$file"
+        fi
+    fi
+    echo "$file"
+}
+
+echo "rev,ring,engine,kind,size,slots,block_size,workers,flags,bytes,seconds,mb_per_s,blocks,p50_us,p99_us,resets,reset_us" > "$CSV"
+for size in $SIZES; do
+    for kind in $KINDS; do
+        in=$(input "$kind" "$size")
+        for ring in $RINGS; do
+            for engine in $ENGINES; do
+                # the stream ciphers only run with the key index that keeps their nonce
+                case "$engine" in aes|chacha) index=-i ;; *) index= ;; esac
+                for slots in $SLOTS; do
+                    for block in $BLOCKS; do
+                        for workers in $WORKERS; do
+                            # shellcheck disable=SC2086
+                            line=$(./encrypt-bench-"$ring" -n "$slots" -m "$slots" -e "$engine" -w "$workers" $index $FLAGS \
+                                "$in" "$DIR/out" "$DIR/log" "$block" 2>&1 >/dev/null | grep '^bench ')
+                            values=$(echo "$line" | sed 's/^bench //; s/[a-z0-9_]*=//g; s/ /,/g')
+                            # flags may hold commas or quotes, so they go in as a quoted field
+                            row="$REV,$ring,$engine,$kind,$size,$slots,$block,$workers,$FLAGS_FIELD,$values"
+                            echo "$row" >> "$CSV"
+                            echo "$row"
+                        done
+                    done
+                done
+            done
+        done
+    done
+done
+rm -f "$DIR/out" "$DIR/log" "$DIR/log.idx"
+
+# the same rows as a JSON array, numbers unquoted
+awk '
+# splits a CSV line into field[1..n], quoted fields lose their quotes
+function split_csv(line,    n, i, c, quoted) {
+    n = 1; field[1] = ""; quoted = 0
+    for (i = 1; i <= length(line); i++) {
+        c = substr(line, i, 1)
+        if (quoted && c == "\"" && substr(line, i + 1, 1) == "\"") { field[n] = field[n] c; i++ }
+        else if (c == "\"") quoted = !quoted
+        else if (c == "," && !quoted) field[++n] = ""
+        else field[n] = field[n] c
+    }
+    return n
+}
+NR == 1 { n = split_csv($0); for (i = 1; i <= n; i++) name[i] = field[i]; print "["; next }
+{
+    printf "%s  {", (NR > 2 ? ",\n" : "")
+    n = split_csv($0)
+    for (i = 1; i <= n; i++) {
+        v = field[i]
+        if (!(v ~ /^-?[0-9]+(\.[0-9]+)?$/ && name[i] != "rev" && name[i] != "size")) {
+            gsub(/\\/, "\\\\", v); gsub(/"/, "\\\"", v); v = "\"" v "\""
+        }
+        printf "%s\"%s\": %s", (i > 1 ? ", " : ""), name[i], v
+    }
+    printf "}"
+}
+END { print "\n]" }' "$CSV" > "$JSON"
+echo "wrote $CSV and $JSON"
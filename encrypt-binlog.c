@@ -0,0 +1,102 @@
+#include "encrypt-binlog.h"
+#include <string.h>
+
+static unsigned char *put_u32(unsigned char *p, unsigned int v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static unsigned char *put_u64(unsigned char *p, unsigned long long v) {
+    p = put_u32(p, v);
+    return put_u32(p, v >> 32);
+}
+
+static unsigned char *put_varint(unsigned char *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static unsigned char *put_counts(unsigned char *p, const long long counts[256]) {
+    int nonzero = 0;
+    for (int i = 0; i < 256; i++) {
+        nonzero += counts[i] != 0;
+    }
+    p = put_varint(p, nonzero);
+    int previous = -1;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] != 0) {
+            p = put_varint(p, i - previous - 1);
+            p = put_varint(p, counts[i]);
+            previous = i;
+        }
+    }
+    return p;
+}
+
+size_t binlog_encode(char *buf, const struct binlog_entry *e) {
+    unsigned char *p = (unsigned char *)buf;
+    p = put_u32(p, e->key);
+    p = put_u64(p, e->input_total_count);
+    p = put_u64(p, e->output_total_count);
+    p = put_counts(p, e->input_counts);
+    p = put_counts(p, e->output_counts);
+    return p - (unsigned char *)buf;
+}
+
+// readers return NULL once they would go past end
+static const unsigned char *get_u32(const unsigned char *p, const unsigned char *end, int *v) {
+    if (!p || end - p < 4) return NULL;
+    *v = (int)(p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24);
+    return p + 4;
+}
+
+static const unsigned char *get_u64(const unsigned char *p, const unsigned char *end, long long *v) {
+    int lo, hi;
+    p = get_u32(p, end, &lo);
+    p = get_u32(p, end, &hi);
+    if (!p) return NULL;
+    *v = (long long)((unsigned long long)(unsigned int)hi << 32 | (unsigned int)lo);
+    return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, unsigned long long *v) {
+    *v = 0;
+    for (int shift = 0; p && p < end && shift < 70; shift += 7) {
+        *v |= (unsigned long long)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) return p;
+    }
+    return NULL;
+}
+
+static const unsigned char *get_counts(const unsigned char *p, const unsigned char *end, long long counts[256]) {
+    unsigned long long nonzero, gap, count;
+    memset(counts, 0, sizeof(long long) * 256);
+    p = get_varint(p, end, &nonzero);
+    int i = -1;
+    for (unsigned long long n = 0; p && n < nonzero; n++) {
+        p = get_varint(p, end, &gap);
+        p = get_varint(p, end, &count);
+        if (!p || gap > (unsigned long long)(255 - i)) return NULL;
+        i += gap + 1;
+        counts[i] = count;
+    }
+    return p;
+}
+
+size_t binlog_decode(const char *buf, size_t len, struct binlog_entry *e) {
+    const unsigned char *start = (const unsigned char *)buf, *end = start + len;
+    const unsigned char *p = start;
+    p = get_u32(p, end, &e->key);
+    p = get_u64(p, end, &e->input_total_count);
+    p = get_u64(p, end, &e->output_total_count);
+    p = get_counts(p, end, e->input_counts);
+    p = get_counts(p, end, e->output_counts);
+    return p ? p - start : 0;
+}
@@ -0,0 +1,40 @@
+#ifndef ENCRYPT_BINLOG_H
+#define ENCRYPT_BINLOG_H
+
+/* Compact binary log. The file starts with BINLOG_MAGIC, or BINLOG_MAGIC_DECRYPT
+ * for the log of a decrypting run where the input is ciphertext and the output
+ * plaintext, then holds one entry per epoch: a fixed header of the key as a
+ * 32-bit and the input and output totals as 64-bit little endian values,
+ * followed by the input and then the output frequency counts. Each histogram is the varint number of non-zero
+ * counts, then for each of them the varint gap to the previous character
+ * (characters skipped since it) and the varint count.
+ */
+
+#include <stddef.h>
+
+#define BINLOG_MAGIC "ENCB"
+#define BINLOG_MAGIC_DECRYPT "ENCD"
+#define BINLOG_MAGIC_SIZE 4
+
+// largest encoded entry: header, two varint lengths and 256 gaps and counts per histogram
+#define BINLOG_ENTRY_MAX (20 + 2 * (2 + 256 * (1 + 10)))
+
+struct binlog_entry {
+    int key;
+    long long input_total_count;
+    long long output_total_count;
+    long long input_counts[256];
+    long long output_counts[256];
+};
+
+/* Encodes e into buf, which needs room for BINLOG_ENTRY_MAX bytes, and
+ * returns the encoded length.
+ */
+size_t binlog_encode(char *buf, const struct binlog_entry *e);
+
+/* Decodes one entry from the len bytes at buf into e. Returns the number of
+ * bytes used, or 0 if buf does not hold a whole entry.
+ */
+size_t binlog_decode(const char *buf, size_t len, struct binlog_entry *e);
+
+#endif // ENCRYPT_BINLOG_H
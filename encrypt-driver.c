@@ -11,7 +11,10 @@
  * 
  * Usage:
  * Compile the program : $make 
- * Run the program: $./encrypt input_file output_file log_file
+ * Run the program: $./encrypt [-a megabytes] [-b] [-c cpus] [-d] [-D index [-r offset:length]] [-e engine] [-f] [-i] [-n slots] [-m slots] [-u depth] [-w workers] input_file output_file log_file [block_size]
+ * Stream stdin to stdout: $./encrypt -n 16 -m 16 - - log_file 65536
+ * Decrypt bytes of an output: $./encrypt -D log_file.idx -r offset:length output_file plain_file log_file
+ * Run a batch of jobs: $./encrypt [options] [-P pipelines] -j manifest [block_size]
  * Clean the build: $make clean
  * 
  */
@@ -19,267 +22,1034 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <getopt.h>
+#include <string.h>
+#include <sys/uio.h>
 
 #include "encrypt-module.h"
+#include "encrypt-ring.h"
+#include "encrypt-affinity.h"
+#include "encrypt-arena.h"
 
-// buffer counts
-int input_count, output_count;
+// benchmark builds time blocks and resets (make bench), the statements vanish otherwise
+#ifdef ENCRYPT_BENCH
+#include "encrypt-bench.h"
+#define BENCH(statement) statement
+#else
+#define BENCH(statement)
+#endif
 
-// input and output buffers
-char* input_buffer;
-char* output_buffer;
+// per-stage counters (make STATS=1), WAIT() also adds the time call blocked to the counter
+#ifdef ENCRYPT_STATS
+#include "encrypt-stats.h"
+#define STATS(statement) statement
+#define WAIT(counter, call) ({                              \
+    long long waited_since = stats_now();                   \
+    __typeof__(call) waited_result = (call);                \
+    stats_add(&stage->counter, stats_now() - waited_since); \
+    waited_result;                                          \
+})
+#else
+#define STATS(statement)
+#define WAIT(counter, call) (call)
+#endif
 
-// Semaphores for signaling data availability in buffers
-sem_t reader_data_ready, counter_data_ready, encryptor_data_ready, output_counter_data_ready, writer_data_ready;
-// Semaphores for signaling processing completion
-sem_t counter_done, encryptor_done, output_counter_done, writer_done;
-// Semaphores for reset coordination
-sem_t counter_reset_ready, encryptor_reset_ready, output_counter_reset_ready, writer_reset_ready;
+// auto-tuning (-a) steers by the stage counters and comes with them, TUNED() runs only with it on
+#ifdef ENCRYPT_STATS
+#include "encrypt-tune.h"
+#define TUNED(statement) do { if (tune_limit > 0) { statement; } } while (0)
+#else
+#define TUNED(statement)
+#endif
 
-// input and output buffer sizes, respectively
-int n, m;
+// timeline of every block and reset (make TRACE=1, recorded when ENCRYPT_TRACE is set)
+#ifdef ENCRYPT_TRACE
+#include "encrypt-trace.h"
+#define TRACE(statement) statement
+#else
+#define TRACE(statement)
+#endif
 
-pthread_mutex_t reader_lock; // locks reader for reset purposes
+// input and output buffer sizes, respectively, asked for unless given with -n and -m
+int n = 0, m = 0;
 
-// Add buffer tracking variables at the top with other globals
-int input_buffer_in = 0;  // Track write position
-int input_buffer_out = 0; // Track read position
-int output_buffer_in = 0; // Track write position
-int output_buffer_out = 0;// Track read position
+// prompts and status messages, on stderr when stdout carries the output
+FILE* messages;
 
-// Reads each character of the file and puts it into the input buffer
-void* readerThread() {
-    char c;
+// number of characters moved through the pipeline per slot
+int block_size = 1;
+
+// memory in megabytes the auto-tuned buffers may take, 0 keeps the sizes fixed (-a)
+int tune_limit = 0;
+
+// largest blocks and buffers the tuner works with, and the time between its decisions
+#define TUNE_MAX_BLOCK 65536
+#define TUNE_MAX_SLOTS 4096
+#define TUNE_INTERVAL_MS 100
+
+// counts and encrypts in one thread instead of three when set (-f)
+int fused = 0;
+
+// cipher engine to use instead of the module's default (-e)
+char* engine_name = NULL;
+
+// writes the log in the binary format when set (-b)
+int binary = 0;
+
+// writes the output file with O_DIRECT when set (-d)
+int direct = 0;
+
+// writes a key index next to each log when set (-i)
+int key_index = 0;
+
+// key index of the input, which is then decrypted instead of encrypted (-D)
+char* decrypt_index = NULL;
+
+// byte range of the input to decrypt, a negative length for the rest of it (-r)
+long long range_offset = 0;
+long long range_length = -1;
+
+// jobs run through the pipelines, three file names each: input, output and log. A plain
+// run is a batch of one job taken from the arguments (-j).
+char** job_names;
+int job_count = 1;
+
+// pipelines running side by side, the jobs of a batch are dealt out to them in turn (-P)
+int pipeline_count = 1;
+
+// CPUs to pin the stages to, "auto" or a list, NULL leaves placement to the scheduler (-c)
+char* cpus = NULL;
+pthread_attr_t placement;
+
+// requests kept in flight by the io_uring reader and writer, 0 for blocking I/O (-u)
+int async_depth = 0;
+
+// most output blocks the writer hands to a single writev
+#define WRITE_BATCH 64
+
+// number of encryptor threads (-w)
+int workers = 1;
+
+// fused workers that can count side by side, one count shard each
+#define FUSED_MAX_WORKERS 16
+
+// Everything one pipeline works on. The settings above are shared and fixed before any
+// pipeline starts, the module state is in the pipeline's encrypt_ctx.
+struct pipeline {
+    struct encrypt_ctx* ctx;
+    // the jobs of this pipeline, three file names each
+    char** job_names;
+    int job_count;
+    // jobs dropped from job_names since their files did not open
+    int skipped_jobs;
+
+    // input and output buffers, each slot holds one block of block_size characters
+    char* input_buffer;
+    char* output_buffer;
+    // start of each input block, inside the mapped input file or the slot's space in input_buffer
+    const char** input_blocks;
+    // number of valid characters in each slot, 0 marks the end of the input
+    int* input_lengths;
+    int* output_lengths;
+    // the parts of each input block with the key they are encrypted with and the epoch they
+    // are counted in, taken when it was read; every slot has room for slot_spans of them
+    struct block_span* input_spans;
+    int* input_span_counts;
+    int slot_spans;
+    // input offset and file nonce of each block, stream ciphers derive their keystream from them
+    long long* input_offsets;
+    const unsigned char** input_nonces;
+    // spans of each output block, copied from its input block
+    struct block_span* output_spans;
+    int* output_span_counts;
+    // output slots whose block is encrypted but not yet handed on
+    char* output_finished;
+#ifdef ENCRYPT_BENCH
+    // when each block was read, carried from its input slot to its output slot
+    long long* input_times;
+    long long* output_times;
+    // output slots of the batch takeBatch() took last
+    int batch_slots[WRITE_BATCH];
+#endif
+
+    pthread_mutex_t dispatch_lock; // hands out input blocks to encryptors in order
+    pthread_mutex_t complete_lock; // hands finished blocks on to the output side in order
+    int input_finished;            // the last job's empty block has been taken by an encryptor
+    int ends_taken;                // empty blocks taken by encryptors, one per job
+    int next_publish;              // next output slot to hand on
+
+    // slot bookkeeping for both buffers, every consumer keeps its own read position
+    struct ring input_ring, output_ring;
+
+#ifdef ENCRYPT_STATS
+    // blocks in flight in either buffer and the block length the reader asks for, as tuned
+    struct depth_gate input_gate, output_gate;
+    atomic_int tuned_block;
+#endif
+
+    pthread_t reader, input_counter, output_counter, writer;
+    pthread_t* encryptors;
+};
+
+// counters of the calling thread's stage
+STATS(_Thread_local struct stage_stats* stage;)
+
+// consumer numbers on the input and output rings, the fused topology only has the first ones
+#define ENCRYPTOR 0
+#define INPUT_COUNTER 1
+#define WRITER 0
+#define OUTPUT_COUNTER 1
+
+// The buffers' slots are taken and given back through these, which with auto-tuning also
+// keep the blocks in flight within the tuned depth. A credit stands for a slot both
+// consumers are done with, so the ring has a free slot whenever a credit was taken.
+int acquireInput(struct pipeline* p) {
+    TUNED(gate_enter(&p->input_gate));
+    return ring_acquire(&p->input_ring);
+}
+
+int tryAcquireInput(struct pipeline* p) {
+    TUNED(if (!gate_try_enter(&p->input_gate)) return -1);
+    return ring_try_acquire(&p->input_ring);
+}
+
+void releaseInput(struct pipeline* p, int consumer) {
+    ring_release(&p->input_ring, consumer);
+    TUNED(gate_leave(&p->input_gate, consumer));
+}
+
+int acquireOutput(struct pipeline* p) {
+    TUNED(gate_enter(&p->output_gate));
+    return ring_acquire(&p->output_ring);
+}
+
+void releaseOutput(struct pipeline* p, int consumer) {
+    ring_release(&p->output_ring, consumer);
+    TUNED(gate_leave(&p->output_gate, consumer));
+}
+
+// attributes that start a thread on its planned CPU, NULL when nothing is pinned
+pthread_attr_t* placed(enum affinity_role role, int index) {
+    if (!cpus) {
+        return NULL;
+    }
+    affinity_attr(&placement, role, index);
+    return &placement;
+}
+
+// slot space read by the stage given, on that stage's NUMA node when placed
+char* allocateBuffer(struct pipeline* p, size_t size, enum affinity_role reader) {
+    return arena_alloc(encrypt_ctx_arena(p->ctx), size, cpus ? affinity_node(reader, 0) : -1);
+}
+
+// The module returns its errors instead of ending the process. An io_uring request the
+// kernel failed leaves the job with a gap, and a thread without a count shard would lose
+// counts, so either ends the run.
+void ioFailed(struct pipeline* p) {
+    fprintf(messages, "Error: %s\n", encrypt_ctx_error(p->ctx));
+    exit(1);
+}
+
+void countFailed(void) {
+    fprintf(messages, "Error: More threads count into a pipeline than it has count shards for\n");
+    exit(1);
+}
+
+// the spans of an input or an output slot
+struct block_span* inputSpans(struct pipeline* p, int slot) {
+    return &p->input_spans[slot * p->slot_spans];
+}
+
+struct block_span* outputSpans(struct pipeline* p, int slot) {
+    return &p->output_spans[slot * p->slot_spans];
+}
+
+// length of the next block to read, the tuned one up to the slot size
+int nextBlockSize(struct pipeline* p) {
+    (void)p;
+    TUNED(return atomic_load_explicit(&p->tuned_block, memory_order_relaxed));
+    return block_size;
+}
+
+// Keeps up to async_depth reads queued in free input slots and puts each block into
+// the input buffer once its read is complete, in file order
+void readAhead(struct pipeline* p) {
+    int* queued = malloc(sizeof(int) * async_depth); // slots with a read queued, oldest first
+    int first = 0, count = 0, end_queued = 0;
+    int len;
+    do {
+        // queue reads into every slot that is free right now, waiting for one only
+        // when nothing is queued
+        while (!end_queued && count < async_depth) {
+            int slot = count == 0 ? WAIT(slot_wait_ns, acquireInput(p)) : tryAcquireInput(p);
+            if (slot < 0) break;
+            p->input_blocks[slot] = p->input_buffer + slot * block_size;
+            int queued_len = read_input_submit(p->ctx, p->input_buffer + slot * block_size, nextBlockSize(p));
+            if (queued_len < 0) ioFailed(p);
+            end_queued = queued_len == 0;
+            queued[(first + count) % async_depth] = slot;
+            count++;
+        }
+
+        int slot = queued[first];
+        first = (first + 1) % async_depth;
+        count--;
+        TRACE(long long traced_since = trace_now());
+        len = read_input_complete(p->ctx);
+        if (len < 0) ioFailed(p);
+        p->input_lengths[slot] = len;
+        p->input_span_counts[slot] = get_spans(p->ctx, inputSpans(p, slot));
+        p->input_offsets[slot] = get_offset(p->ctx);
+        p->input_nonces[slot] = get_nonce(p->ctx);
+        BENCH(p->input_times[slot] = bench_now());
+        STATS(stats_block(stage, len));
+        TRACE(trace_span(TRACE_READ, traced_since, inputSpans(p, slot)->epoch));
+        ring_publish(&p->input_ring);
+    } while (len > 0);
+    free(queued);
+}
+
+// Opens job of a pipeline, or the first one after it that opens. A job whose files
+// cannot be opened is reported and dropped, the jobs after it move up and the threads
+// expect one end block fewer. Returns 0 once no job is left to open.
+int openJob(struct pipeline* p, int job) {
+    while (job < p->job_count && !init(p->ctx, p->job_names[3 * job], p->job_names[3 * job + 1], p->job_names[3 * job + 2])) {
+        fprintf(messages, "Error: %s, skipping the job\n", encrypt_ctx_error(p->ctx));
+        memmove(&p->job_names[3 * job], &p->job_names[3 * (job + 1)], sizeof(char*) * 3 * (p->job_count - job - 1));
+        p->job_count--;
+        p->skipped_jobs++;
+    }
+    return job < p->job_count;
+}
+
+// Reads the file one block at a time and puts each block into the input buffer
+void* readerThread(void* arg) {
+    struct pipeline* p = arg;
+    STATS(stage = stats_stage("reader"));
+    TRACE(trace_thread("reader"));
+    if (input_async(p->ctx)) {
+        readAhead(p);
+        return NULL;
+    }
+    int len, job = 0;
     do {
-        pthread_mutex_lock(&reader_lock);
-        c = read_input();
+        // wait until both consumers have released the next slot
+        int slot = WAIT(slot_wait_ns, acquireInput(p));
+        TRACE(long long traced_since = trace_now());
 
-        // Write to the next input position
-        input_buffer[input_buffer_in] = c;
-        input_buffer_in = (input_buffer_in + 1) % n;
+        // mapped input is not copied, unless the mapping goes away with the next job
+        if (!p->input_buffer) {
+            len = read_input_view(p->ctx, &p->input_blocks[slot], nextBlockSize(p));
+        } else {
+            p->input_blocks[slot] = p->input_buffer + slot * block_size;
+            len = read_input_block(p->ctx, p->input_buffer + slot * block_size, nextBlockSize(p));
+        }
+        p->input_lengths[slot] = len;
+        // any reset before or inside this block has finished by now
+        p->input_span_counts[slot] = get_spans(p->ctx, inputSpans(p, slot));
+        p->input_offsets[slot] = get_offset(p->ctx);
+        p->input_nonces[slot] = get_nonce(p->ctx);
+        BENCH(p->input_times[slot] = bench_now());
+        STATS(stats_block(stage, len));
+        TRACE(trace_span(TRACE_READ, traced_since, inputSpans(p, slot)->epoch));
+
+        // the next job is opened before the end of this one goes out, so the writer finds its
+        // output file in place when it gets there, and the other threads see the job count
+        // without the jobs that were skipped
+        if (len == 0) {
+            openJob(p, ++job);
+        }
 
         // Signal threads waiting for input
-        sem_post(&counter_data_ready);
-        sem_post(&encryptor_data_ready);
-        
-        // Wait for processing to complete
-        sem_wait(&counter_done);
-        sem_wait(&encryptor_done);
-
-        pthread_mutex_unlock(&reader_lock);
-    } while (c != EOF);
-
-    // Signal one more time to ensure other threads process EOF
-    sem_post(&counter_data_ready);
-    sem_post(&encryptor_data_ready);
+        ring_publish(&p->input_ring);
+    } while (len > 0 || job < p->job_count);
     return NULL;
 }
 
-// reads each character in input buffer as they are entered and adds it to the count
-void* inputCounterThread() {
-    char c;
+// reads each block in input buffer as they are entered and adds it to the count
+void* inputCounterThread(void* arg) {
+    struct pipeline* p = arg;
+    STATS(stage = stats_stage("input counter"));
+    TRACE(trace_thread("input counter"));
+    int len, ends = 0;
     do {
-        sem_wait(&counter_data_ready);
-        c = input_buffer[input_buffer_out];
-        sem_post(&counter_done);
-        sem_post(&counter_reset_ready);
-
-        if(c != EOF) {
-            count_input(c);
+        int slot = WAIT(data_wait_ns, ring_next(&p->input_ring, INPUT_COUNTER));
+        TRACE(long long traced_since = trace_now());
+        len = p->input_lengths[slot];
+        const struct block_span* spans = inputSpans(p, slot);
+        for (int i = 0, offset = 0; i < p->input_span_counts[slot]; offset += spans[i++].length) {
+            if (!count_input_block(p->ctx, p->input_blocks[slot] + offset, spans[i].length, spans[i].epoch)) countFailed();
         }
-    } while (c != EOF);
+        TRACE(trace_span(TRACE_COUNT_INPUT, traced_since, spans->epoch));
+        STATS(stats_block(stage, len));
+        releaseInput(p, INPUT_COUNTER);
+    } while (len > 0 || ++ends < p->job_count);
     return NULL;
 }
 
-// gets character from input, encrypts it, and places it into output
-void* encryptorThread() {
-    char c;
+// gets a block from input, encrypts it, and places it into output. Several of these run side
+// by side, blocks are taken in input order and handed on in the same order once encrypted.
+void* encryptorThread(void* arg) {
+    struct pipeline* p = arg;
+    STATS(stage = stats_stage(fused ? "fused worker" : "encryptor"));
+    TRACE(trace_thread(fused ? "fused worker" : "encryptor"));
+    int len, last;
     do {
-        sem_wait(&encryptor_data_ready);
-        c = input_buffer[input_buffer_out];
-        input_buffer_out = (input_buffer_out + 1) % n;
-        sem_post(&encryptor_done);
-
-        if (c != EOF) {
-            output_buffer[output_buffer_in] = encrypt(c);
-            output_buffer_in = (output_buffer_in + 1) % m;
-            
-            // Signal output processing
-            sem_post(&output_counter_data_ready);
-            sem_post(&writer_data_ready);
+        // take the next input block together with the output slot it will end up in
+        pthread_mutex_lock(&p->dispatch_lock);
+        if (p->input_finished) {
+            pthread_mutex_unlock(&p->dispatch_lock);
+            break;
         }
-        sem_post(&encryptor_reset_ready);
+        int in_slot = WAIT(data_wait_ns, ring_next(&p->input_ring, ENCRYPTOR));
+        int out_slot = WAIT(slot_wait_ns, acquireOutput(p));
+        len = p->input_lengths[in_slot];
+        // the end of each job's input is passed on as an empty block by whoever takes it
+        last = p->input_finished = len == 0 && ++p->ends_taken == p->job_count;
+        pthread_mutex_unlock(&p->dispatch_lock);
 
-        // Wait for output processing only if not EOF
-        if (c != EOF) {
-            sem_wait(&output_counter_done);
-            sem_wait(&writer_done);
+        const char* in = p->input_blocks[in_slot];
+        char* out = p->output_buffer + out_slot * block_size;
+        const struct block_span* spans = inputSpans(p, in_slot);
+        int span_count = p->input_span_counts[in_slot];
+        TRACE(long long traced_since = trace_now());
+        for (int i = 0, offset = 0; i < span_count; offset += spans[i++].length) {
+            long long input_offset = p->input_offsets[in_slot] + offset;
+            if (!fused) {
+                encrypt_block(p->ctx, in + offset, out + offset, spans[i].length, spans[i].key, input_offset, p->input_nonces[in_slot]);
+            } else if (!encrypt_count_block(p->ctx, in + offset, out + offset, spans[i].length, spans[i].key, input_offset,
+                                            p->input_nonces[in_slot], spans[i].epoch)) {
+                countFailed();
+            } else if (spans[i].whole) {
+                // no other block has any of the epoch, it need not wait for the blocks before
+                count_whole_epoch(p->ctx, spans[i].epoch);
+            }
         }
-    } while (c != EOF);
+        STATS(stats_block(stage, len));
+        TRACE(trace_span(fused ? TRACE_ENCRYPT_COUNT : TRACE_ENCRYPT, traced_since, spans->epoch));
+        p->output_lengths[out_slot] = len;
+        memcpy(outputSpans(p, out_slot), spans, sizeof(struct block_span) * span_count);
+        p->output_span_counts[out_slot] = span_count;
+        BENCH(p->output_times[out_slot] = p->input_times[in_slot]);
 
-    // Signal EOF to output threads
-    output_buffer[output_buffer_in] = EOF;
-    output_buffer_in = (output_buffer_in + 1) % m;
-    sem_post(&output_counter_data_ready);
-    sem_post(&writer_data_ready);
+        // Signal output processing for every block that is now finished in order
+        pthread_mutex_lock(&p->complete_lock);
+        p->output_finished[out_slot] = 1;
+        while (p->output_finished[p->next_publish]) {
+            p->output_finished[p->next_publish] = 0;
+            if (fused) {
+                // blocks reach here in read order, so their epochs can be finished, the last
+                // one too once nothing more of it can come, or the next block might wait on it
+                const struct block_span* last = &outputSpans(p, p->next_publish)[p->output_span_counts[p->next_publish] - 1];
+                count_finished(p->ctx, last->epoch + last->last);
+            }
+            p->next_publish = (p->next_publish + 1) % m;
+            ring_publish(&p->output_ring);
+            releaseInput(p, ENCRYPTOR);
+        }
+        pthread_mutex_unlock(&p->complete_lock);
+    } while (!last);
     return NULL;
 }
 
 // reads output from output buffer and counts for logging
 void* outputCounterThread(void* arg) {
-    char c;
+    struct pipeline* p = arg;
+    STATS(stage = stats_stage("output counter"));
+    TRACE(trace_thread("output counter"));
+    int len, ends = 0;
     do {
-        sem_wait(&output_counter_data_ready);
-        c = output_buffer[output_buffer_out];
-        if(c != EOF) {
-            count_output(c);
+        int slot = WAIT(data_wait_ns, ring_next(&p->output_ring, OUTPUT_COUNTER));
+        TRACE(long long traced_since = trace_now());
+        char* block = p->output_buffer + slot * block_size;
+        len = p->output_lengths[slot];
+        const struct block_span* spans = outputSpans(p, slot);
+        for (int i = 0, offset = 0; i < p->output_span_counts[slot]; offset += spans[i++].length) {
+            if (!count_output_block(p->ctx, block + offset, spans[i].length, spans[i].epoch)) countFailed();
         }
-        sem_post(&output_counter_done);
-        sem_post(&output_counter_reset_ready);
-    } while (c != EOF);
+        TRACE(trace_span(TRACE_COUNT_OUTPUT, traced_since, spans->epoch));
+        STATS(stats_block(stage, len));
+        releaseOutput(p, OUTPUT_COUNTER);
+    } while (len > 0 || ++ends < p->job_count);
     return NULL;
 }
 
-// reads output buffer and places it into output file
+#ifdef ENCRYPT_BENCH
+// times the blocks of the last batch, now that they are written or queued
+void timeBatch(struct pipeline* p, int taken) {
+    for (int i = 0; i < taken; i++) {
+        bench_block_written(p->output_times[p->batch_slots[i]], p->output_lengths[p->batch_slots[i]]);
+    }
+}
+#endif
+
+// takes the next output block and every further one already waiting, up to WRITE_BATCH,
+// returns how many slots were taken and sets *last to the length of the last one
+int takeBatch(struct pipeline* p, struct iovec* batch, int* count, int* last, int wait) {
+    int taken = 0;
+    *count = 0;
+    int slot = wait ? WAIT(data_wait_ns, ring_next(&p->output_ring, WRITER)) : ring_try_next(&p->output_ring, WRITER);
+    while (slot >= 0) {
+        BENCH(p->batch_slots[taken] = slot);
+        *last = p->output_lengths[slot];
+        STATS(stats_block(stage, *last));
+        if (*last > 0) {
+            batch[*count].iov_base = p->output_buffer + slot * block_size;
+            batch[*count].iov_len = *last;
+            (*count)++;
+        }
+        taken++;
+        if (*last == 0 || taken == WRITE_BATCH) break;
+        slot = ring_try_next(&p->output_ring, WRITER);
+    }
+    return taken;
+}
+
+// Keeps up to async_depth writes queued and releases slots as their writes complete.
+// With writes queued the writer never blocks on the output buffer, the encryptor may
+// be waiting for exactly those slots.
+void writeBehind(struct pipeline* p) {
+    struct iovec batch[WRITE_BATCH];
+    int* taken = malloc(sizeof(int) * async_depth); // slots per queued write, oldest first
+    int first = 0, queued = 0, count, len = 1;
+    while (len > 0 || queued > 0) {
+        int got = len > 0 && queued < async_depth ? takeBatch(p, batch, &count, &len, queued == 0) : 0;
+        if (got > 0) {
+            TRACE(long long traced_since = trace_now());
+            if (!write_output_submit(p->ctx, batch, count)) ioFailed(p);
+            TRACE(trace_span(TRACE_WRITE, traced_since, count));
+            BENCH(timeBatch(p, got));
+            taken[(first + queued) % async_depth] = got;
+            queued++;
+        } else {
+            if (!write_output_complete(p->ctx)) ioFailed(p);
+            for (int i = 0; i < taken[first]; i++) {
+                releaseOutput(p, WRITER);
+            }
+            first = (first + 1) % async_depth;
+            queued--;
+        }
+    }
+    free(taken);
+}
+
+// reads output buffer and places it into output file, every block that is already
+// waiting goes out together with one writev
 void* writerThread(void* arg) {
-    char c;
+    struct pipeline* p = arg;
+    STATS(stage = stats_stage("writer"));
+    TRACE(trace_thread("writer"));
+    if (output_async(p->ctx)) {
+        writeBehind(p);
+        if (!flush_output(p->ctx)) ioFailed(p);
+        return NULL;
+    }
+    struct iovec batch[WRITE_BATCH];
+    int count, len, ends = 0;
     do {
-        sem_wait(&writer_data_ready);
-        c = output_buffer[output_buffer_out];
-        output_buffer_out = (output_buffer_out + 1) % m;
-        
-        if(c != EOF) {
-            write_output(c);
+        // a batch ends with the empty block that ends a job
+        int taken = takeBatch(p, batch, &count, &len, 1);
+        TRACE(long long traced_since = trace_now());
+        write_output_blocks(p->ctx, batch, count);
+        TRACE(trace_span(TRACE_WRITE, traced_since, count));
+        BENCH(timeBatch(p, taken));
+        for (int i = 0; i < taken; i++) {
+            releaseOutput(p, WRITER);
         }
-        sem_post(&writer_done);
-        sem_post(&writer_reset_ready);
-    } while (c != EOF);
+        if (len == 0) {
+            finish_output(p->ctx);
+        }
+    } while (len > 0 || ++ends < p->job_count);
     return NULL;
 }
 
-// when reset is called, locks reader, waits for other threads to catch up, resets buffer counter and logs result for current key
-void reset_requested() {
-    pthread_mutex_lock(&reader_lock);
-    sem_wait(&counter_reset_ready);
-    sem_wait(&encryptor_reset_ready);
-    sem_wait(&output_counter_reset_ready);
-    sem_wait(&writer_reset_ready);
-    
-    // Reset all buffer positions
-    input_buffer_in = 0;
-    input_buffer_out = 0;
-    output_buffer_in = 0;
-    output_buffer_out = 0;
-    input_count = 0;
-    output_count = 0;
-    
-    log_counts();
+// nothing to stop on a reset, blocks carry their key and epoch through the pipeline
+// and every epoch is counted and logged on its own
+STATS(_Thread_local long long reset_since;)
+TRACE(_Thread_local long long traced_reset_since;)
+
+void reset_requested(struct encrypt_ctx* ctx) {
+    (void)ctx;
+    BENCH(bench_reset_begin());
+    STATS(reset_since = stats_now());
+    TRACE(traced_reset_since = trace_now());
+}
+
+void reset_finished(struct encrypt_ctx* ctx) {
+    (void)ctx;
+    BENCH(bench_reset_end());
+    STATS(stats_add(&stage->resets, 1));
+    STATS(stats_add(&stage->reset_ns, stats_now() - reset_since));
+    TRACE(trace_span(TRACE_RESET, traced_reset_since, get_epoch(ctx)));
+}
+
+// reads the jobs of a batch from the manifest, one line of input, output and log file
+// names each, skipping blank lines and lines starting with #
+void readManifest(const char* name) {
+    FILE* manifest = fopen(name, "r");
+    if (!manifest) {
+        fprintf(stderr, "Error: cannot read the manifest %s\n", name);
+        exit(1);
+    }
+    char line[3 * 4096];
+    int line_number = 0, capacity = 0;
+    job_count = 0;
+    while (fgets(line, sizeof(line), manifest)) {
+        line_number++;
+        char* names[4];
+        int fields = 0;
+        for (char* field = strtok(line, " \t\r\n"); field && fields < 4; field = strtok(NULL, " \t\r\n")) {
+            names[fields++] = field;
+        }
+        if (fields == 0 || names[0][0] == '#') {
+            continue;
+        }
+        if (fields != 3) {
+            fprintf(stderr, "Error: Manifest line %d must name an input, an output and a log file\n", line_number);
+            exit(1);
+        }
+        if (job_count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            job_names = realloc(job_names, sizeof(char*) * 3 * capacity);
+        }
+        for (int i = 0; i < 3; i++) {
+            job_names[3 * job_count + i] = strdup(names[i]);
+        }
+        job_count++;
+    }
+    fclose(manifest);
+    if (job_count == 0) {
+        fprintf(stderr, "Error: Manifest %s holds no jobs\n", name);
+        exit(1);
+    }
+}
+
+// Opens the first job of pipeline index, which runs every pipeline_count-th job of the
+// batch starting with job index. Returns 0 if none of its jobs could be opened.
+int openPipeline(struct pipeline* p, int index) {
+    p->job_count = (job_count - index + pipeline_count - 1) / pipeline_count;
+    p->job_names = malloc(sizeof(char*) * 3 * p->job_count);
+    p->ctx = encrypt_ctx_new(p);
+    if (!p->job_names || !p->ctx) {
+        fprintf(messages, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int j = 0; j < p->job_count; j++) {
+        memcpy(&p->job_names[3 * j], &job_names[3 * (index + j * pipeline_count)], sizeof(char*) * 3);
+    }
+    // the input and output counters, or every fused worker, count into the epochs
+    set_count_threads(p->ctx, fused ? workers : 2);
+    // blocks go on over the resets inside them, each of their spans has its own key and epoch
+    p->slot_spans = block_spans(p->ctx, block_size);
+    set_block_spans(p->ctx, p->slot_spans);
+    if (engine_name && !select_engine(p->ctx, engine_name)) {
+        // the stream ciphers also need their secret key
+        fprintf(messages, "Error: Cipher engine %s is unknown or has no ENCRYPT_KEY\n", engine_name);
+        exit(1);
+    }
+
+    // the nonce of a stream cipher is only kept in the key index
+    if (!decrypt_index && !key_index && needs_key_index(p->ctx)) {
+        fprintf(messages, "Error: Cipher engine %s needs -i, its output cannot be decrypted without the key index\n", engine_name);
+        exit(1);
+    }
+
+    // initializes files for encrypt module
+    if (!openJob(p, 0)) {
+        return 0;
+    }
+    if (decrypt_index && !enable_decrypt(p->ctx, decrypt_index)) {
+        fprintf(messages, "Error: %s is not a key index\n", decrypt_index);
+        exit(1);
+    }
+    // the binary log header records the direction
+    if (binary && !enable_binary_log(p->ctx)) {
+        fprintf(messages, "Warning: binary log not supported, writing the text log\n");
+    }
+    if (key_index && !enable_key_index(p->ctx)) {
+        if (needs_key_index(p->ctx)) {
+            fprintf(messages, "Error: Cipher engine %s needs a key index, which a log that is not a file cannot have\n", engine_name);
+            exit(1);
+        }
+        fprintf(messages, "Warning: no key index for a log that is not a file\n");
+    }
+    // reads are queued from the start of the range, so it is sought to first
+    if (range_length >= 0 && !seek_input(p->ctx, range_offset, range_length)) {
+        fprintf(messages, "Error: Ranges are decrypted from regular input files only\n");
+        exit(1);
+    }
+    if (direct && !enable_direct_output(p->ctx)) {
+        fprintf(messages, "Warning: O_DIRECT not supported for the output file, writing buffered\n");
+    }
+    if (async_depth > 0 && !enable_async_io(p->ctx, async_depth)) {
+        fprintf(messages, "Warning: io_uring not available for these files, using blocking I/O\n");
+    }
+    return 1;
+}
+
+// allocates the buffers of a pipeline, all of it up front in its arena next to the
+// epoch count sets, and sets up their bookkeeping
+void setupPipeline(struct pipeline* p) {
+    // mapped input is handed out in place and needs no buffer space of its own
+    int in_place = p->job_count == 1 && input_mapped(p->ctx);
+    struct arena* arena = encrypt_ctx_arena(p->ctx);
+    p->input_buffer = in_place ? NULL : allocateBuffer(p, sizeof(char) * n * block_size, AFFINITY_WORKER);
+    p->output_buffer = allocateBuffer(p, sizeof(char) * m * block_size, AFFINITY_WRITER);
+    p->input_blocks = arena_alloc(arena, sizeof(char*) * n, -1);
+    p->input_lengths = arena_alloc(arena, sizeof(int) * n, -1);
+    p->output_lengths = arena_alloc(arena, sizeof(int) * m, -1);
+    p->input_spans = arena_alloc(arena, sizeof(struct block_span) * n * p->slot_spans, -1);
+    p->input_span_counts = arena_alloc(arena, sizeof(int) * n, -1);
+    p->input_offsets = arena_alloc(arena, sizeof(long long) * n, -1);
+    p->input_nonces = arena_alloc(arena, sizeof(const unsigned char*) * n, -1);
+    p->output_spans = arena_alloc(arena, sizeof(struct block_span) * m * p->slot_spans, -1);
+    p->output_span_counts = arena_alloc(arena, sizeof(int) * m, -1);
+    p->output_finished = arena_alloc(arena, sizeof(char) * m, -1);
+    BENCH(p->input_times = arena_alloc(arena, sizeof(long long) * n, -1));
+    BENCH(p->output_times = arena_alloc(arena, sizeof(long long) * m, -1));
+    if ((!p->input_buffer && !in_place) || !p->output_buffer || !p->input_blocks || !p->input_lengths || !p->output_lengths || !p->input_spans || !p->input_span_counts || !p->input_offsets || !p->input_nonces || !p->output_spans || !p->output_span_counts || !p->output_finished) {
+        fprintf(messages, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+
+    // Initialize buffer bookkeeping, every slot starts out free
+    int consumers = fused ? 1 : 2;
+    ring_init(&p->input_ring, n, consumers);
+    ring_init(&p->output_ring, m, consumers);
+
+    // initializes encryptor mutexes
+    pthread_mutex_init(&p->dispatch_lock, NULL);
+    pthread_mutex_init(&p->complete_lock, NULL);
+}
+
+// creates the threads of a pipeline
+void startPipeline(struct pipeline* p) {
+    p->encryptors = malloc(sizeof(pthread_t) * workers);
+    pthread_create(&p->reader, placed(AFFINITY_READER, 0), readerThread, p);
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&p->encryptors[i], placed(AFFINITY_WORKER, i), encryptorThread, p);
+    }
+    if (!fused) {
+        pthread_create(&p->input_counter, placed(AFFINITY_INPUT_COUNTER, 0), inputCounterThread, p);
+        pthread_create(&p->output_counter, placed(AFFINITY_OUTPUT_COUNTER, 0), outputCounterThread, p);
+    }
+    pthread_create(&p->writer, placed(AFFINITY_WRITER, 0), writerThread, p);
 }
 
-// when called, unlocks reader
-void reset_finished() {
-    pthread_mutex_unlock(&reader_lock);
+// waits for every thread of a pipeline and cleans up after them
+void joinPipeline(struct pipeline* p) {
+    pthread_join(p->reader, NULL);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(p->encryptors[i], NULL);
+    }
+    if (!fused) {
+        pthread_join(p->input_counter, NULL);
+        pthread_join(p->output_counter, NULL);
+    }
+    pthread_join(p->writer, NULL);
+    free(p->encryptors);
+
+    // destroys encryptor locks
+    pthread_mutex_destroy(&p->dispatch_lock);
+    pthread_mutex_destroy(&p->complete_lock);
+
+    // Cleanup buffer bookkeeping
+    ring_destroy(&p->input_ring);
+    ring_destroy(&p->output_ring);
 }
 
 int main(int argc, char *argv[]) {
-    // checks for exactly 4 arguments
-    if (argc != 4) {
+    int opt;
+    char* manifest = NULL;
+    messages = stdout;
+    while ((opt = getopt(argc, argv, "a:bc:dD:e:fij:m:n:P:r:u:w:")) != -1) {
+        switch (opt) {
+        case 'a':
+            tune_limit = atoi(optarg);
+            if (tune_limit < 1) {
+                fprintf(stderr, "Error: Auto-tune memory limit must be greater than 0\n");
+                exit(1);
+            }
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 'c':
+            cpus = optarg;
+            break;
+        case 'd':
+            direct = 1;
+            break;
+        case 'D':
+            decrypt_index = optarg;
+            break;
+        case 'i':
+            key_index = 1;
+            break;
+        case 'r':
+            if (sscanf(optarg, "%lld:%lld", &range_offset, &range_length) != 2 || range_offset < 0 || range_length < 0) {
+                fprintf(stderr, "Error: Range must be given as offset:length\n");
+                exit(1);
+            }
+            break;
+        case 'P':
+            pipeline_count = atoi(optarg);
+            if (pipeline_count < 1) {
+                fprintf(stderr, "Error: Pipeline count must be greater than 0\n");
+                exit(1);
+            }
+            break;
+        case 'u':
+            async_depth = atoi(optarg);
+            if (async_depth < 1) {
+                fprintf(stderr, "Error: io_uring depth must be greater than 0\n");
+                exit(1);
+            }
+            break;
+        case 'e':
+            engine_name = optarg;
+            break;
+        case 'f':
+            fused = 1;
+            break;
+        case 'j':
+            manifest = optarg;
+            break;
+        case 'n':
+            n = atoi(optarg);
+            if (n < 1) {
+                fprintf(stderr, "Error: Buffer size must be greater than 0\n");
+                exit(1);
+            }
+            break;
+        case 'm':
+            m = atoi(optarg);
+            if (m < 1) {
+                fprintf(stderr, "Error: Buffer size must be greater than 0\n");
+                exit(1);
+            }
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            if (workers < 1) {
+                fprintf(stderr, "Error: Worker count must be greater than 0\n");
+                exit(1);
+            }
+            break;
+        default:
+            exit(1);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+#ifndef ENCRYPT_STATS
+    if (tune_limit > 0) {
+        fprintf(stderr, "Warning: auto-tuning needs a build with make STATS=1, using fixed sizes\n");
+        tune_limit = 0;
+    }
+#endif
+#ifdef ENCRYPT_BENCH
+    if (pipeline_count > 1) {
+        fprintf(stderr, "Warning: benchmark builds time a single pipeline, running one\n");
+        pipeline_count = 1;
+    }
+#endif
+    // the tuner steers one set of buffers and the placement plan covers one set of threads
+    if (pipeline_count > 1 && (tune_limit > 0 || cpus)) {
+        fprintf(stderr, "Warning: -a and -c apply to a single pipeline, ignored with -P\n");
+        tune_limit = 0;
+        cpus = NULL;
+    }
+
+    // checks for 4 arguments and an optional block size, or just the block size with a manifest
+    int files = manifest ? 0 : 3;
+    if (argc != files + 1 && argc != files + 2) {
         printf("Error: Must include an input file, an output file, and a log file in arguments\n");
+        printf("Usage: encrypt [-a megabytes] [-b] [-c cpus] [-d] [-D index [-r offset:length]] [-e engine] [-f] [-i] [-n slots] [-m slots] [-u depth] [-w workers] input_file output_file log_file [block_size]\n");
+        printf("       -c pins the stages to the CPUs listed, like 0-3,8, or placed by topology with auto\n");
+        printf("       -a tunes buffer depths and the block size within the megabytes given,\n");
+        printf("       then -n and -m are the depths to start from and block_size the largest block\n");
+        printf("       a file name of - reads stdin or writes stdout, or stderr for the log\n");
+        printf("       -i writes the key index log_file.idx, -D decrypts an output with its index\n");
+        printf("       and -r only the bytes from offset on, as many as length\n");
+        printf("   or: encrypt [options] [-P pipelines] -j manifest [block_size]\n");
+        printf("       runs the jobs of a manifest, one line of input_file output_file log_file each\n");
+        printf("       -P runs that many pipelines side by side, each taking every P-th job\n");
         exit(1);
     }
+    if (range_length >= 0 && !decrypt_index) {
+        fprintf(stderr, "Error: A range is only decrypted with -D\n");
+        exit(1);
+    }
+    if (manifest) {
+        // one index covers one file
+        if (decrypt_index) {
+            fprintf(stderr, "Error: Batch jobs cannot be decrypted with -D\n");
+            exit(1);
+        }
+        readManifest(manifest);
+        // the writer switches files between jobs, which the staging of both keeps from happening
+        if (direct || async_depth > 0) {
+            fprintf(stderr, "Warning: batch jobs are written without O_DIRECT and io_uring\n");
+            direct = async_depth = 0;
+        }
+    } else {
+        job_names = argv + 1;
+    }
+    // the output stream must carry nothing but the output
+    if (strcmp(job_names[1], "-") == 0) {
+        messages = stderr;
+    }
+    // a prompt would read its answer out of the input stream
+    if (strcmp(job_names[0], "-") == 0 && (n == 0 || m == 0) && tune_limit == 0) {
+        fprintf(messages, "Error: Buffer sizes must be given with -n and -m when reading stdin\n");
+        exit(1);
+    }
+    if (fused && workers > FUSED_MAX_WORKERS) {
+        // every fused worker counts into a shard of its own
+        fprintf(messages, "Error: Fused mode runs at most %d encryptors\n", FUSED_MAX_WORKERS);
+        exit(1);
+    }
+    if (cpus && !affinity_plan(cpus, workers, fused)) {
+        fprintf(messages, "Error: CPU list %s names no CPU this process may run on\n", cpus);
+        exit(1);
+    }
+    if (argc == files + 2) {
+        block_size = atoi(argv[files + 1]);
+        if (block_size < 1) {
+            fprintf(messages, "Error: Block size must be greater than 0\n");
+            exit(1);
+        }
+    }
 
-    // initializes files for encrypt module
-    init(argv[1], argv[2], argv[3]);
+#ifdef ENCRYPT_STATS
+    // the buffers get as many slots of the largest block as the limit allows, the gates
+    // keep the depth in use below that, starting from -n and -m when given
+    int input_depth = n > 0 ? n : 8, output_depth = m > 0 ? m : 8, tuned_start = block_size;
+    if (tune_limit > 0) {
+        if (argc != files + 2) {
+            block_size = TUNE_MAX_BLOCK;
+        }
+        // a slot needs no room past what one block can bring, which is also the tuner's cap
+        block_size = block_reach(block_size);
+        long long slots = (long long)tune_limit * 1024 * 1024 / block_size / 2;
+        if (slots < 2) {
+            fprintf(messages, "Error: Auto-tune memory limit holds fewer than 2 blocks per buffer\n");
+            exit(1);
+        }
+        n = m = slots < TUNE_MAX_SLOTS ? slots : TUNE_MAX_SLOTS;
+        int block = block_size / 16;
+        tuned_start = block < 16 ? (block_size < 16 ? block_size : 16) : block;
+    }
+#endif
 
-    // loops until receiving valid buffer input
-    do {
-        printf("\nEnter buffer size for the input: ");
-        scanf("%d", &n);
-        if (n < 1) printf("\nInvalid buffer, must be greater than 0\n");
-    } while(n < 1);
-    
-    do {
-        printf("Enter buffer size for the output: ");
-        scanf("%d", &m);
-        if (m < 1) printf("\nInvalid buffer, must be greater than 0\n");
-    } while(m < 1);
-
-    // allocates buffer size
-    input_buffer = malloc(sizeof(char) * n);
-    output_buffer = malloc(sizeof(char) * m); 
-    if (!input_buffer || !output_buffer) {
-        printf("Error: Memory allocation failed\n");
+    // the jobs of a batch are dealt out in turn, a pipeline without a job is not started
+    if (pipeline_count > job_count) {
+        pipeline_count = job_count;
+    }
+    struct pipeline* pipelines = calloc(pipeline_count, sizeof(struct pipeline));
+    if (!pipelines) {
+        fprintf(messages, "Error: Memory allocation failed\n");
         exit(1);
     }
 
-    // keeps track of buffer count
-    input_count = 0;
-    output_count = 0;
-
-    // Initialize semaphores for data availability
-    sem_init(&reader_data_ready, 0, 0);
-    sem_init(&counter_data_ready, 0, 0);
-    sem_init(&encryptor_data_ready, 0, 0);
-    sem_init(&output_counter_data_ready, 0, 0);
-    sem_init(&writer_data_ready, 0, 0);
-
-    // Initialize semaphores for processing completion
-    sem_init(&counter_done, 0, 0);
-    sem_init(&encryptor_done, 0, 0);
-    sem_init(&output_counter_done, 0, 0);
-    sem_init(&writer_done, 0, 0);
-
-    // Initialize semaphores for reset coordination
-    sem_init(&counter_reset_ready, 0, 0);
-    sem_init(&encryptor_reset_ready, 0, 0);
-    sem_init(&output_counter_reset_ready, 0, 0);
-    sem_init(&writer_reset_ready, 0, 0);
-
-    // initializes reader mutex
-    pthread_mutex_init(&reader_lock, NULL);
-    
+    // before init() starts the logger threads, which must not take SIGUSR1 either
+    STATS(stats_on_signal());
+    TRACE(trace_init());
+
+    // a pipeline none of whose jobs opened is dropped, the run fails once every one is
+    int opened = 0, skipped_jobs = 0;
+    for (int i = 0; i < pipeline_count; i++) {
+        struct pipeline* p = &pipelines[opened];
+        if (openPipeline(p, i)) {
+            opened++;
+        } else {
+            skipped_jobs += p->skipped_jobs;
+            encrypt_ctx_free(p->ctx);
+            free(p->job_names);
+            memset(p, 0, sizeof(struct pipeline));
+        }
+    }
+    pipeline_count = opened;
+    if (pipeline_count == 0) {
+        free(pipelines);
+        exit(1);
+    }
+
+    // loops until receiving valid buffer input
+    while (n < 1) {
+        fprintf(messages, "\nEnter buffer size for the input: ");
+        fflush(messages);
+        if (scanf("%d", &n) != 1) exit(1);
+        if (n < 1) fprintf(messages, "\nInvalid buffer, must be greater than 0\n");
+    }
+
+    while (m < 1) {
+        fprintf(messages, "Enter buffer size for the output: ");
+        fflush(messages);
+        if (scanf("%d", &m) != 1) exit(1);
+        if (m < 1) fprintf(messages, "\nInvalid buffer, must be greater than 0\n");
+    }
+
+    for (int i = 0; i < pipeline_count; i++) {
+        setupPipeline(&pipelines[i]);
+    }
+#ifdef ENCRYPT_STATS
+    // only one pipeline runs with auto-tuning
+    struct pipeline* tuned = &pipelines[0];
+    struct tune_settings tuning = {&tuned->input_gate, &tuned->output_gate, &tuned->tuned_block, 16, block_size, TUNE_INTERVAL_MS};
+    if (tuning.min_block > block_size) {
+        tuning.min_block = block_size;
+    }
+    TUNED(atomic_init(&tuned->tuned_block, tuned_start));
+    TUNED(gate_init(&tuned->input_gate, n, input_depth, fused ? 1 : 2));
+    TUNED(gate_init(&tuned->output_gate, m, output_depth, fused ? 1 : 2));
+    TUNED(tune_start(&tuning));
+#endif
+
     // creates threads
-    pthread_t reader, input_counter, encryptor, output_counter, writer;
-    pthread_create(&reader, NULL, readerThread, NULL);
-    pthread_create(&input_counter, NULL, inputCounterThread, NULL);
-    pthread_create(&encryptor, NULL, encryptorThread, NULL);
-    pthread_create(&output_counter, NULL, outputCounterThread, NULL);
-    pthread_create(&writer, NULL, writerThread, NULL);
+    if (cpus) {
+        pthread_attr_init(&placement);
+        affinity_print(messages);
+    }
+    BENCH(bench_start());
+    for (int i = 0; i < pipeline_count; i++) {
+        startPipeline(&pipelines[i]);
+    }
+    if (cpus) {
+        pthread_attr_destroy(&placement);
+    }
 
     // runs threads
-    pthread_join(reader, NULL);
-    pthread_join(input_counter, NULL);
-    pthread_join(encryptor, NULL);
-    pthread_join(output_counter, NULL);
-    pthread_join(writer, NULL);
-
-    // destroys reader lock
-    pthread_mutex_destroy(&reader_lock);
-
-    // Cleanup semaphores for data availability
-    sem_destroy(&reader_data_ready);
-    sem_destroy(&counter_data_ready);
-    sem_destroy(&encryptor_data_ready);
-    sem_destroy(&output_counter_data_ready);
-    sem_destroy(&writer_data_ready);
-
-    // Cleanup semaphores for processing completion
-    sem_destroy(&counter_done);
-    sem_destroy(&encryptor_done);
-    sem_destroy(&output_counter_done);
-    sem_destroy(&writer_done);
-
-    // Cleanup semaphores for reset coordination
-    sem_destroy(&counter_reset_ready);
-    sem_destroy(&encryptor_reset_ready);
-    sem_destroy(&output_counter_reset_ready);
-    sem_destroy(&writer_reset_ready);
-
-    // free allocated memory
-    free(input_buffer);
-    free(output_buffer);
-
-    printf("\nEnd of file reached.\n"); 
-    log_counts();
-    return 0;
+    for (int i = 0; i < pipeline_count; i++) {
+        joinPipeline(&pipelines[i]);
+        skipped_jobs += pipelines[i].skipped_jobs;
+    }
+#ifdef ENCRYPT_STATS
+    TUNED(tune_stop());
+    // what the tuner settled on, to pass in place of -a next time
+    TUNED(fprintf(messages, "\nAuto-tuned: -n %d -m %d block_size %d\n", gate_depth(&tuned->input_gate),
+                  gate_depth(&tuned->output_gate), atomic_load(&tuned->tuned_block)));
+    TUNED(gate_destroy(&tuned->input_gate));
+    TUNED(gate_destroy(&tuned->output_gate));
+#endif
+    BENCH(bench_stop());
+    TRACE(trace_dump());
+
+    fprintf(messages, "\nEnd of file reached.\n"); 
+    for (int i = 0; i < pipeline_count; i++) {
+        log_counts(pipelines[i].ctx);
+    }
+    BENCH(bench_report(stderr));
+    STATS(stats_print(stderr));
+
+    for (int i = 0; i < pipeline_count; i++) {
+        STATS(arena_print(encrypt_ctx_arena(pipelines[i].ctx), stderr));
+        // the buffers, and the epoch count sets the log was written from
+        encrypt_ctx_free(pipelines[i].ctx);
+        free(pipelines[i].job_names);
+    }
+    free(pipelines);
+    // the other jobs ran to the end, but the batch is not complete
+    return skipped_jobs > 0;
 }
@@ -0,0 +1,268 @@
+/* AES-256 in counter mode. The secret key comes from ENCRYPT_KEY, the pipeline's
+ * key numbers the epochs and goes up by 1 at every reset. Counter block n of
+ * an epoch is the file's 12 byte nonce followed by 4 zero bytes, with the key
+ * as a 32-bit big endian number XORed into bytes 4-7 and n as a 64-bit one
+ * into bytes 8-15. Within a file no two (key, n) share a block and files differ
+ * in their random nonce, and every block's keystream follows from its input
+ * offset alone.
+ */
+#include "encrypt-engine.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_FEATURE_AES)
+#include <arm_neon.h>
+#endif
+
+#define AES_BLOCK 16
+#define AES_ROUNDS 14
+
+static const unsigned char sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+// round keys in the byte order of FIPS-197, which AES-NI and the ARMv8 instructions use as well
+static _Alignas(16) unsigned char round_keys[AES_ROUNDS + 1][AES_BLOCK];
+static int have_secret = 0;
+static pthread_once_t aes_ready = PTHREAD_ONCE_INIT;
+
+static void expand_key(const unsigned char secret[32]) {
+    unsigned char *w = &round_keys[0][0];
+    unsigned char rcon = 1;
+    memcpy(w, secret, 32);
+    for (int i = 8; i < 4 * (AES_ROUNDS + 1); i++) {
+        unsigned char t[4];
+        memcpy(t, w + 4 * (i - 1), 4);
+        if (i % 8 == 0) {
+            unsigned char first = t[0];
+            t[0] = sbox[t[1]] ^ rcon;
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[first];
+            rcon = rcon << 1 ^ (rcon & 0x80 ? 0x1b : 0);
+        } else if (i % 8 == 4) {
+            for (int j = 0; j < 4; j++) t[j] = sbox[t[j]];
+        }
+        for (int j = 0; j < 4; j++) {
+            w[4 * i + j] = w[4 * (i - 8) + j] ^ t[j];
+        }
+    }
+}
+
+// the counter block of block number 0 under key for nonce
+static void counter_base(unsigned char base[AES_BLOCK], int key, const unsigned char *nonce) {
+    unsigned int k = key;
+    memcpy(base, nonce, ENGINE_NONCE_SIZE);
+    memset(base + ENGINE_NONCE_SIZE, 0, AES_BLOCK - ENGINE_NONCE_SIZE);
+    for (int i = 0; i < 4; i++) {
+        base[4 + i] ^= k >> (24 - 8 * i);
+    }
+}
+
+// counter block number block, from the base of its key and nonce
+static void counter_block(unsigned char *b, unsigned long long block, const unsigned char base[AES_BLOCK]) {
+    unsigned long long low;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    block = __builtin_bswap64(block);
+#endif
+    memcpy(&low, base + 8, 8);
+    low ^= block;
+    memcpy(b, base, 8);
+    memcpy(b + 8, &low, 8);
+}
+
+static unsigned char xtime(unsigned char x) {
+    return x << 1 ^ (x & 0x80 ? 0x1b : 0);
+}
+
+static void encrypt_soft(unsigned char *s) {
+    for (int j = 0; j < AES_BLOCK; j++) s[j] ^= round_keys[0][j];
+    for (int r = 1; r <= AES_ROUNDS; r++) {
+        unsigned char t[AES_BLOCK];
+        // SubBytes and ShiftRows, the state is stored column by column
+        for (int c = 0; c < 4; c++) {
+            for (int row = 0; row < 4; row++) {
+                t[4 * c + row] = sbox[s[4 * ((c + row) % 4) + row]];
+            }
+        }
+        if (r < AES_ROUNDS) {
+            for (int c = 0; c < 4; c++) {
+                unsigned char *col = t + 4 * c;
+                unsigned char all = col[0] ^ col[1] ^ col[2] ^ col[3], first = col[0];
+                col[0] ^= all ^ xtime(col[0] ^ col[1]);
+                col[1] ^= all ^ xtime(col[1] ^ col[2]);
+                col[2] ^= all ^ xtime(col[2] ^ col[3]);
+                col[3] ^= all ^ xtime(col[3] ^ first);
+            }
+        }
+        for (int j = 0; j < AES_BLOCK; j++) s[j] = t[j] ^ round_keys[r][j];
+    }
+}
+
+static void keystream_soft(unsigned char *ks, unsigned long long first, size_t blocks, int key, const unsigned char *nonce) {
+    unsigned char base[AES_BLOCK];
+    counter_base(base, key, nonce);
+    for (size_t b = 0; b < blocks; b++) {
+        counter_block(ks + AES_BLOCK * b, first + b, base);
+        encrypt_soft(ks + AES_BLOCK * b);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// eight blocks side by side keep the AES unit busy while each round waits on the last
+__attribute__((target("aes,sse2")))
+static void keystream_aesni(unsigned char *ks, unsigned long long first, size_t blocks, int key, const unsigned char *nonce) {
+    unsigned char base[AES_BLOCK];
+    counter_base(base, key, nonce);
+    __m128i rk[AES_ROUNDS + 1];
+    for (int r = 0; r <= AES_ROUNDS; r++) {
+        rk[r] = _mm_load_si128((const __m128i *)round_keys[r]);
+    }
+    size_t b = 0;
+    for (; b + 8 <= blocks; b += 8) {
+        __m128i x[8];
+        for (int i = 0; i < 8; i++) {
+            counter_block(ks + AES_BLOCK * (b + i), first + b + i, base);
+            x[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(ks + AES_BLOCK * (b + i))), rk[0]);
+        }
+        for (int r = 1; r < AES_ROUNDS; r++) {
+            for (int i = 0; i < 8; i++) x[i] = _mm_aesenc_si128(x[i], rk[r]);
+        }
+        for (int i = 0; i < 8; i++) {
+            _mm_storeu_si128((__m128i *)(ks + AES_BLOCK * (b + i)), _mm_aesenclast_si128(x[i], rk[AES_ROUNDS]));
+        }
+    }
+    for (; b < blocks; b++) {
+        counter_block(ks + AES_BLOCK * b, first + b, base);
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(ks + AES_BLOCK * b)), rk[0]);
+        for (int r = 1; r < AES_ROUNDS; r++) x = _mm_aesenc_si128(x, rk[r]);
+        _mm_storeu_si128((__m128i *)(ks + AES_BLOCK * b), _mm_aesenclast_si128(x, rk[AES_ROUNDS]));
+    }
+}
+
+// four blocks per 512-bit register, four registers at a time. A short batch still runs
+// all sixteen lanes, which costs less than running what it needs one block at a time.
+__attribute__((target("vaes,avx512f,aes,sse2")))
+static void keystream_vaes(unsigned char *ks, unsigned long long first, size_t blocks, int key, const unsigned char *nonce) {
+    unsigned char base[AES_BLOCK];
+    counter_base(base, key, nonce);
+    __m512i rk[AES_ROUNDS + 1];
+    for (int r = 0; r <= AES_ROUNDS; r++) {
+        rk[r] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)round_keys[r]));
+    }
+    for (size_t b = 0; b < blocks; b += 16) {
+        _Alignas(64) unsigned char batch[16 * AES_BLOCK];
+        __m512i x[4];
+        size_t n = blocks - b < 16 ? blocks - b : 16;
+        for (int i = 0; i < 16; i++) {
+            counter_block(batch + AES_BLOCK * i, first + b + i, base);
+        }
+        for (int i = 0; i < 4; i++) {
+            x[i] = _mm512_xor_si512(_mm512_load_si512(batch + 4 * AES_BLOCK * i), rk[0]);
+        }
+        for (int r = 1; r < AES_ROUNDS; r++) {
+            for (int i = 0; i < 4; i++) x[i] = _mm512_aesenc_epi128(x[i], rk[r]);
+        }
+        for (int i = 0; i < 4; i++) {
+            _mm512_store_si512(batch + 4 * AES_BLOCK * i, _mm512_aesenclast_epi128(x[i], rk[AES_ROUNDS]));
+        }
+        memcpy(ks + AES_BLOCK * b, batch, AES_BLOCK * n);
+    }
+}
+#elif defined(__ARM_FEATURE_AES)
+static void keystream_arm(unsigned char *ks, unsigned long long first, size_t blocks, int key, const unsigned char *nonce) {
+    unsigned char base[AES_BLOCK];
+    counter_base(base, key, nonce);
+    uint8x16_t rk[AES_ROUNDS + 1];
+    for (int r = 0; r <= AES_ROUNDS; r++) {
+        rk[r] = vld1q_u8(round_keys[r]);
+    }
+    for (size_t b = 0; b < blocks; b++) {
+        counter_block(ks + AES_BLOCK * b, first + b, base);
+        uint8x16_t x = vld1q_u8(ks + AES_BLOCK * b);
+        // AESE adds the round key before SubBytes and ShiftRows, so the rounds shift by one
+        for (int r = 0; r < AES_ROUNDS - 1; r++) x = vaesmcq_u8(vaeseq_u8(x, rk[r]));
+        x = veorq_u8(vaeseq_u8(x, rk[AES_ROUNDS - 1]), rk[AES_ROUNDS]);
+        vst1q_u8(ks + AES_BLOCK * b, x);
+    }
+}
+#endif
+
+static void (*keystream_kernel)(unsigned char *, unsigned long long, size_t, int, const unsigned char *) = keystream_soft;
+
+// picks the widest AES instructions there are, ENCRYPT_SIMD=scalar|aesni forces a narrower kernel
+static void aes_setup() {
+    unsigned char secret[32];
+    if (!engine_secret(secret)) {
+        return;
+    }
+    expand_key(secret);
+    memset(secret, 0, sizeof(secret));
+    have_secret = 1;
+
+    const char *forced = getenv("ENCRYPT_SIMD");
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes")) {
+        keystream_kernel = keystream_aesni;
+        if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f") &&
+            !(forced && strcmp(forced, "aesni") == 0)) {
+            keystream_kernel = keystream_vaes;
+        }
+    }
+#elif defined(__ARM_FEATURE_AES)
+    keystream_kernel = keystream_arm;
+#endif
+    if (forced && strcmp(forced, "scalar") == 0) {
+        keystream_kernel = keystream_soft;
+    }
+}
+
+static int aes_init() {
+    pthread_once(&aes_ready, aes_setup);
+    return have_secret;
+}
+
+static int aes_on_reset(int k) {
+    return k + 1;
+}
+
+static void aes_encrypt_block(const char *in, char *out, size_t len, int k, long long offset, const unsigned char *nonce) {
+    ctr_xor(in, out, len, offset, k, nonce, AES_BLOCK, keystream_kernel);
+}
+
+static int aes_encrypt(int c, int k, long long offset, const unsigned char *nonce) {
+    char in = c, out;
+    aes_encrypt_block(&in, &out, 1, k, offset, nonce);
+    return (unsigned char)out;
+}
+
+const struct cipher_engine aes_engine = {
+    .name = "aes",
+    .initial_key = 1,
+    .uses_nonce = 1,
+    .init = aes_init,
+    .on_reset = aes_on_reset,
+    .encrypt = aes_encrypt,
+    .encrypt_block = aes_encrypt_block,
+    // counter mode is its own inverse
+    .decrypt_block = aes_encrypt_block,
+    .count_block = count_lanes,
+};
@@ -0,0 +1,117 @@
+/* The alphabetic Caesar cipher: letters move key places on and wrap around
+ * once, everything else passes unchanged. Characters are counted in upper
+ * case and the key goes up by 1 at every reset.
+ */
+#include "encrypt-engine.h"
+#include <ctype.h>
+#include <pthread.h>
+#include "encrypt-table.h"
+
+// Past the alphabet every letter wraps and the result only matters modulo 256 once
+// stored in a char, so keys from CAESAR_TABLE_KEYS on repeat every 256 keys.
+#define CAESAR_TABLE_KEYS 26
+static struct cipher_table key_tables[CAESAR_TABLE_KEYS + 256];
+static struct cipher_table inverse_tables[CAESAR_TABLE_KEYS + 256];
+static unsigned char upper[256];
+static pthread_once_t tables_built = PTHREAD_ONCE_INIT;
+
+static int caesar_encrypt(int c, int k) {
+    if (c >= 'a' && c <= 'z') {
+        c += k;
+        if (c > 'z') {
+            c = c - 'z' + 'a' - 1;
+        }
+    } else if (c >= 'A' && c <= 'Z') {
+        c += k;
+        if (c > 'Z') {
+            c = c - 'Z' + 'A' - 1;
+        }
+    }
+    return c;
+}
+
+static void build_tables() {
+    for (int k = 0; k < CAESAR_TABLE_KEYS + 256; k++) {
+        table_build(&key_tables[k], caesar_encrypt, k);
+        table_invert(&inverse_tables[k], &key_tables[k]);
+    }
+    for (int i = 0; i < 256; i++) {
+        upper[i] = toupper(i);
+    }
+}
+
+static int caesar_init() {
+    pthread_once(&tables_built, build_tables);
+    return 1;
+}
+
+static int caesar_on_reset(int k) {
+    return k + 1;
+}
+
+// the table of a key that is not negative
+static int fold_key(int k) {
+    return k < CAESAR_TABLE_KEYS ? k : CAESAR_TABLE_KEYS + (k - CAESAR_TABLE_KEYS) % 256;
+}
+
+static void caesar_encrypt_block(const char *in, char *out, size_t len, int k, long long offset, const unsigned char *nonce) {
+    (void)offset;
+    (void)nonce;
+    pthread_once(&tables_built, build_tables);
+    if (k >= 0) {
+        table_encrypt(&key_tables[fold_key(k)], in, out, len);
+        return;
+    }
+    // letters are never wrapped for negative keys
+    for (size_t i = 0; i < len; i++) {
+        out[i] = caesar_encrypt(in[i], k);
+    }
+}
+
+static void caesar_decrypt_block(const char *in, char *out, size_t len, int k, long long offset, const unsigned char *nonce) {
+    (void)offset;
+    (void)nonce;
+    pthread_once(&tables_built, build_tables);
+    if (k >= 0) {
+        table_encrypt(&inverse_tables[fold_key(k)], in, out, len);
+        return;
+    }
+    // negative keys are left out of the tables, their inverse is built for the call
+    struct cipher_table forward, inverse;
+    table_build(&forward, caesar_encrypt, k);
+    table_invert(&inverse, &forward);
+    table_encrypt(&inverse, in, out, len);
+}
+
+static void caesar_count_block(unsigned int lanes[COUNT_LANES][256], const char *buf, size_t len) {
+    pthread_once(&tables_built, build_tables);
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        lanes[0][upper[p[i]]]++;
+        lanes[1][upper[p[i + 1]]]++;
+        lanes[2][upper[p[i + 2]]]++;
+        lanes[3][upper[p[i + 3]]]++;
+    }
+    for (; i < len; i++) {
+        lanes[i & (COUNT_LANES - 1)][upper[p[i]]]++;
+    }
+}
+
+// the offset only matters to stream ciphers
+static int caesar_encrypt_char(int c, int k, long long offset, const unsigned char *nonce) {
+    (void)offset;
+    (void)nonce;
+    return caesar_encrypt(c, k);
+}
+
+const struct cipher_engine caesar_engine = {
+    .name = "caesar",
+    .initial_key = 1,
+    .init = caesar_init,
+    .on_reset = caesar_on_reset,
+    .encrypt = caesar_encrypt_char,
+    .encrypt_block = caesar_encrypt_block,
+    .decrypt_block = caesar_decrypt_block,
+    .count_block = caesar_count_block,
+};
@@ -0,0 +1,222 @@
+/* ChaCha20 with a 64-bit block counter. The secret key comes from ENCRYPT_KEY,
+ * the pipeline's key numbers the epochs and goes up by 1 at every reset. Block
+ * n of the input is made with counter n in words 12 and 13 and the file's 12
+ * byte nonce in words 13 to 15, the key XORed into word 14. Within a file no
+ * two (key, n) share a state and files differ in their random nonce, and
+ * every block's keystream follows from its input offset alone.
+ */
+#include "encrypt-engine.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define CHACHA_BLOCK 64
+
+static uint32_t key_words[8];
+static int have_secret = 0;
+static pthread_once_t chacha_ready = PTHREAD_ONCE_INIT;
+
+// state words 0-3 of every block, "expand 32-byte k"
+static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+static uint32_t rotl(uint32_t x, int n) {
+    return x << n | x >> (32 - n);
+}
+
+#define QUARTER(a, b, c, d)                                                  \
+    a += b, d = rotl(d ^ a, 16), c += d, b = rotl(b ^ c, 12),               \
+    a += b, d = rotl(d ^ a, 8), c += d, b = rotl(b ^ c, 7)
+
+// little endian word i of the nonce
+static uint32_t nonce_word(const unsigned char *nonce, int i) {
+    const unsigned char *p = nonce + 4 * i;
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void block_state(uint32_t s[16], unsigned long long block, int key, const unsigned char *nonce) {
+    memcpy(s, sigma, sizeof(sigma));
+    memcpy(s + 4, key_words, sizeof(key_words));
+    s[12] = (uint32_t)block;
+    s[13] = (uint32_t)(block >> 32) ^ nonce_word(nonce, 0);
+    s[14] = nonce_word(nonce, 1) ^ (uint32_t)key;
+    s[15] = nonce_word(nonce, 2);
+}
+
+static void store_word(unsigned char *p, uint32_t w) {
+    p[0] = w;
+    p[1] = w >> 8;
+    p[2] = w >> 16;
+    p[3] = w >> 24;
+}
+
+static void keystream_scalar(unsigned char *ks, unsigned long long first, size_t blocks, int key, const unsigned char *nonce) {
+    for (size_t b = 0; b < blocks; b++) {
+        uint32_t s[16], x[16];
+        block_state(s, first + b, key, nonce);
+        memcpy(x, s, sizeof(s));
+        for (int r = 0; r < 10; r++) {
+            QUARTER(x[0], x[4], x[8], x[12]);
+            QUARTER(x[1], x[5], x[9], x[13]);
+            QUARTER(x[2], x[6], x[10], x[14]);
+            QUARTER(x[3], x[7], x[11], x[15]);
+            QUARTER(x[0], x[5], x[10], x[15]);
+            QUARTER(x[1], x[6], x[11], x[12]);
+            QUARTER(x[2], x[7], x[8], x[13]);
+            QUARTER(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; i++) {
+            store_word(ks + CHACHA_BLOCK * b + 4 * i, x[i] + s[i]);
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The vector kernels run one block per lane: register i holds state word i of
+ * every block, so the rounds are the scalar ones on whole registers. Only the
+ * counter words differ between lanes. A short batch still runs every lane and
+ * keeps the blocks it needs, a reset interval is only a few blocks long.
+ */
+#define VQUARTER(add, xor, rot, a, b, c, d)                                  \
+    a = add(a, b), d = rot(xor(d, a), 16), c = add(c, d), b = rot(xor(b, c), 12), \
+    a = add(a, b), d = rot(xor(d, a), 8), c = add(c, d), b = rot(xor(b, c), 7)
+
+#define VROUNDS(add, xor, rot, x)                                            \
+    for (int r = 0; r < 10; r++) {                                           \
+        VQUARTER(add, xor, rot, x[0], x[4], x[8], x[12]);                    \
+        VQUARTER(add, xor, rot, x[1], x[5], x[9], x[13]);                    \
+        VQUARTER(add, xor, rot, x[2], x[6], x[10], x[14]);                   \
+        VQUARTER(add, xor, rot, x[3], x[7], x[11], x[15]);                   \
+        VQUARTER(add, xor, rot, x[0], x[5], x[10], x[15]);                   \
+        VQUARTER(add, xor, rot, x[1], x[6], x[11], x[12]);                   \
+        VQUARTER(add, xor, rot, x[2], x[7], x[8], x[13]);                    \
+        VQUARTER(add, xor, rot, x[3], x[4], x[9], x[14]);                    \
+    }
+
+__attribute__((target("avx2")))
+static __m256i rotl8x32(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2")))
+static void keystream_avx2(unsigned char *ks, unsigned long long first, size_t blocks, int key, const unsigned char *nonce) {
+    uint32_t s[16];
+    for (size_t b = 0; b < blocks; b += 8) {
+        _Alignas(32) uint32_t words[16][8];
+        __m256i x[16], init[16];
+        block_state(s, first + b, key, nonce);
+        for (int i = 0; i < 16; i++) {
+            init[i] = _mm256_set1_epi32(s[i]);
+        }
+        for (int l = 0; l < 8; l++) {
+            words[12][l] = (uint32_t)(first + b + l);
+            words[13][l] = (uint32_t)((first + b + l) >> 32) ^ nonce_word(nonce, 0);
+        }
+        init[12] = _mm256_load_si256((const __m256i *)words[12]);
+        init[13] = _mm256_load_si256((const __m256i *)words[13]);
+        memcpy(x, init, sizeof(x));
+        VROUNDS(_mm256_add_epi32, _mm256_xor_si256, rotl8x32, x);
+        for (int i = 0; i < 16; i++) {
+            _mm256_store_si256((__m256i *)words[i], _mm256_add_epi32(x[i], init[i]));
+        }
+        for (size_t l = 0; l < 8 && b + l < blocks; l++) {
+            for (int i = 0; i < 16; i++) {
+                store_word(ks + CHACHA_BLOCK * (b + l) + 4 * i, words[i][l]);
+            }
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void keystream_avx512(unsigned char *ks, unsigned long long first, size_t blocks, int key, const unsigned char *nonce) {
+    uint32_t s[16];
+    for (size_t b = 0; b < blocks; b += 16) {
+        _Alignas(64) uint32_t words[16][16];
+        __m512i x[16], init[16];
+        block_state(s, first + b, key, nonce);
+        for (int i = 0; i < 16; i++) {
+            init[i] = _mm512_set1_epi32(s[i]);
+        }
+        for (int l = 0; l < 16; l++) {
+            words[12][l] = (uint32_t)(first + b + l);
+            words[13][l] = (uint32_t)((first + b + l) >> 32) ^ nonce_word(nonce, 0);
+        }
+        init[12] = _mm512_load_si512(words[12]);
+        init[13] = _mm512_load_si512(words[13]);
+        memcpy(x, init, sizeof(x));
+        VROUNDS(_mm512_add_epi32, _mm512_xor_si512, _mm512_rol_epi32, x);
+        for (int i = 0; i < 16; i++) {
+            _mm512_store_si512(words[i], _mm512_add_epi32(x[i], init[i]));
+        }
+        for (size_t l = 0; l < 16 && b + l < blocks; l++) {
+            for (int i = 0; i < 16; i++) {
+                store_word(ks + CHACHA_BLOCK * (b + l) + 4 * i, words[i][l]);
+            }
+        }
+    }
+}
+#endif
+
+static void (*keystream_kernel)(unsigned char *, unsigned long long, size_t, int, const unsigned char *) = keystream_scalar;
+
+// picks the widest vector kernel there is, ENCRYPT_SIMD=scalar|avx2 forces a narrower one
+static void chacha_setup() {
+    unsigned char secret[32];
+    if (!engine_secret(secret)) {
+        return;
+    }
+    for (int i = 0; i < 8; i++) {
+        key_words[i] = secret[4 * i] | secret[4 * i + 1] << 8 | secret[4 * i + 2] << 16 |
+                       (uint32_t)secret[4 * i + 3] << 24;
+    }
+    memset(secret, 0, sizeof(secret));
+    have_secret = 1;
+
+    const char *forced = getenv("ENCRYPT_SIMD");
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && !(forced && strcmp(forced, "avx2") == 0)) {
+        keystream_kernel = keystream_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        keystream_kernel = keystream_avx2;
+    }
+#endif
+    if (forced && strcmp(forced, "scalar") == 0) {
+        keystream_kernel = keystream_scalar;
+    }
+}
+
+static int chacha_init() {
+    pthread_once(&chacha_ready, chacha_setup);
+    return have_secret;
+}
+
+static int chacha_on_reset(int k) {
+    return k + 1;
+}
+
+static void chacha_encrypt_block(const char *in, char *out, size_t len, int k, long long offset, const unsigned char *nonce) {
+    ctr_xor(in, out, len, offset, k, nonce, CHACHA_BLOCK, keystream_kernel);
+}
+
+static int chacha_encrypt(int c, int k, long long offset, const unsigned char *nonce) {
+    char in = c, out;
+    chacha_encrypt_block(&in, &out, 1, k, offset, nonce);
+    return (unsigned char)out;
+}
+
+const struct cipher_engine chacha_engine = {
+    .name = "chacha",
+    .initial_key = 1,
+    .uses_nonce = 1,
+    .init = chacha_init,
+    .on_reset = chacha_on_reset,
+    .encrypt = chacha_encrypt,
+    .encrypt_block = chacha_encrypt_block,
+    // counter mode is its own inverse
+    .decrypt_block = chacha_encrypt_block,
+    .count_block = count_lanes,
+};
@@ -0,0 +1,203 @@
+/* The printable range shift: (c + key - 32) % 94 + 32 on each char, with C's
+ * truncating remainder, and the key going up by 5 at every reset.
+ */
+#include "encrypt-engine.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "encrypt-table.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Folds key into [-189, 253] without changing (c + key - 32) % 94 for any char c.
+// Above 159 every c + key - 32 is non-negative and below -95 every one is negative,
+// so whole multiples of 94 can be dropped there without flipping a remainder's sign.
+static int fold_key(int k) {
+    if (k >= 160) return 160 + (k - 160) % 94;
+    if (k <= -96) return -96 - (-96 - k) % 94;
+    return k;
+}
+
+static int shift_encrypt(int c, int k);
+
+static void encrypt_block_scalar(const char *in, char *out, size_t len, int k) {
+    for (size_t i = 0; i < len; i++) {
+        out[i] = (in[i] + k - 32) % 94 + 32;
+    }
+}
+
+// one table for every folded key, built once when the kernels are selected
+#define FOLDED_KEY_MIN -189
+#define FOLDED_KEY_MAX 253
+static struct cipher_table key_tables[FOLDED_KEY_MAX - FOLDED_KEY_MIN + 1];
+// and their inverses, the decrypt kernel is a lookup per character
+static struct cipher_table inverse_tables[FOLDED_KEY_MAX - FOLDED_KEY_MIN + 1];
+
+// a lookup per character, used where no vector kernel applies and for their tails
+static void encrypt_block_table(const char *in, char *out, size_t len, int k) {
+    table_encrypt(&key_tables[k - FOLDED_KEY_MIN], in, out, len);
+}
+
+/* The vector kernels widen to 16-bit lanes, where c + key - 32 lies in [-349, 348]
+ * for a folded key. The % 94 is done on the magnitude with three compare-and-subtract
+ * steps and the sign is put back afterwards, matching C's truncating remainder.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static inline __m128i shift_epi16_sse2(__m128i c, __m128i k) {
+    const __m128i m93 = _mm_set1_epi16(93), m94 = _mm_set1_epi16(94);
+    __m128i x = _mm_add_epi16(c, k);
+    __m128i sign = _mm_srai_epi16(x, 15);
+    __m128i r = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+    r = _mm_sub_epi16(r, _mm_and_si128(_mm_cmpgt_epi16(r, m93), m94));
+    r = _mm_sub_epi16(r, _mm_and_si128(_mm_cmpgt_epi16(r, m93), m94));
+    r = _mm_sub_epi16(r, _mm_and_si128(_mm_cmpgt_epi16(r, m93), m94));
+    r = _mm_sub_epi16(_mm_xor_si128(r, sign), sign);
+    return _mm_add_epi16(r, _mm_set1_epi16(32));
+}
+
+__attribute__((target("sse2")))
+static void encrypt_block_sse2(const char *in, char *out, size_t len, int k) {
+    const __m128i kv = _mm_set1_epi16(k - 32);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i sign = _mm_cmpgt_epi8(_mm_setzero_si128(), v);
+        __m128i lo = shift_epi16_sse2(_mm_unpacklo_epi8(v, sign), kv);
+        __m128i hi = shift_epi16_sse2(_mm_unpackhi_epi8(v, sign), kv);
+        // results lie in [-61, 125], so the saturating pack is exact
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi16(lo, hi));
+    }
+    encrypt_block_table(in + i, out + i, len - i, k);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i shift_epi16_avx2(__m256i c, __m256i k) {
+    const __m256i m93 = _mm256_set1_epi16(93), m94 = _mm256_set1_epi16(94);
+    __m256i x = _mm256_add_epi16(c, k);
+    __m256i sign = _mm256_srai_epi16(x, 15);
+    __m256i r = _mm256_abs_epi16(x);
+    r = _mm256_sub_epi16(r, _mm256_and_si256(_mm256_cmpgt_epi16(r, m93), m94));
+    r = _mm256_sub_epi16(r, _mm256_and_si256(_mm256_cmpgt_epi16(r, m93), m94));
+    r = _mm256_sub_epi16(r, _mm256_and_si256(_mm256_cmpgt_epi16(r, m93), m94));
+    r = _mm256_sub_epi16(_mm256_xor_si256(r, sign), sign);
+    return _mm256_add_epi16(r, _mm256_set1_epi16(32));
+}
+
+__attribute__((target("avx2")))
+static void encrypt_block_avx2(const char *in, char *out, size_t len, int k) {
+    const __m256i kv = _mm256_set1_epi16(k - 32);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i sign = _mm256_cmpgt_epi8(_mm256_setzero_si256(), v);
+        // unpack and pack both work per 128-bit lane, so the byte order comes back unchanged
+        __m256i lo = shift_epi16_avx2(_mm256_unpacklo_epi8(v, sign), kv);
+        __m256i hi = shift_epi16_avx2(_mm256_unpackhi_epi8(v, sign), kv);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_packs_epi16(lo, hi));
+    }
+    encrypt_block_sse2(in + i, out + i, len - i, k);
+}
+#elif defined(__ARM_NEON)
+static inline int16x8_t shift_s16_neon(int16x8_t c, int16x8_t k) {
+    const int16x8_t m93 = vdupq_n_s16(93), m94 = vdupq_n_s16(94);
+    int16x8_t x = vaddq_s16(c, k);
+    int16x8_t r = vabsq_s16(x);
+    r = vsubq_s16(r, vandq_s16(vreinterpretq_s16_u16(vcgtq_s16(r, m93)), m94));
+    r = vsubq_s16(r, vandq_s16(vreinterpretq_s16_u16(vcgtq_s16(r, m93)), m94));
+    r = vsubq_s16(r, vandq_s16(vreinterpretq_s16_u16(vcgtq_s16(r, m93)), m94));
+    r = vbslq_s16(vcltq_s16(x, vdupq_n_s16(0)), vnegq_s16(r), r);
+    return vaddq_s16(r, vdupq_n_s16(32));
+}
+
+static void encrypt_block_neon(const char *in, char *out, size_t len, int k) {
+    const int16x8_t kv = vdupq_n_s16(k - 32);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        int8x16_t v = vld1q_s8((const int8_t *)(in + i));
+        int16x8_t lo = shift_s16_neon(vmovl_s8(vget_low_s8(v)), kv);
+        int16x8_t hi = shift_s16_neon(vmovl_s8(vget_high_s8(v)), kv);
+        vst1q_s8((int8_t *)(out + i), vcombine_s8(vmovn_s16(lo), vmovn_s16(hi)));
+    }
+    encrypt_block_table(in + i, out + i, len - i, k);
+}
+#endif
+
+static void (*encrypt_block_kernel)(const char *, char *, size_t, int) = encrypt_block_table;
+static pthread_once_t kernels_selected = PTHREAD_ONCE_INIT;
+
+// Picks the fastest kernel the CPU supports, ENCRYPT_SIMD=scalar|table|sse2 forces a
+// different one. The tables are built first, the vector kernels use them for their tails.
+static void select_kernels() {
+    const char *forced = getenv("ENCRYPT_SIMD");
+    for (int k = FOLDED_KEY_MIN; k <= FOLDED_KEY_MAX; k++) {
+        table_build(&key_tables[k - FOLDED_KEY_MIN], shift_encrypt, k);
+        table_invert(&inverse_tables[k - FOLDED_KEY_MIN], &key_tables[k - FOLDED_KEY_MIN]);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    // the 16-byte arithmetic kernel is slower than the table lookups, only AVX2 beats them
+    if (__builtin_cpu_supports("avx2")) {
+        encrypt_block_kernel = encrypt_block_avx2;
+    }
+    if (forced && strcmp(forced, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        encrypt_block_kernel = encrypt_block_sse2;
+    }
+#elif defined(__ARM_NEON)
+    encrypt_block_kernel = encrypt_block_neon;
+#endif
+    if (forced && strcmp(forced, "table") == 0) {
+        encrypt_block_kernel = encrypt_block_table;
+    }
+    if (forced && strcmp(forced, "scalar") == 0) {
+        encrypt_block_kernel = encrypt_block_scalar;
+    }
+}
+
+static int shift_init() {
+    pthread_once(&kernels_selected, select_kernels);
+    return 1;
+}
+
+static int shift_on_reset(int k) {
+    return k + 5;
+}
+
+static int shift_encrypt(int c, int k) {
+    return (c + k - 32) % 94 + 32;
+}
+
+static void shift_encrypt_block(const char *in, char *out, size_t len, int k, long long offset, const unsigned char *nonce) {
+    (void)offset;
+    (void)nonce;
+    pthread_once(&kernels_selected, select_kernels);
+    encrypt_block_kernel(in, out, len, fold_key(k));
+}
+
+static void shift_decrypt_block(const char *in, char *out, size_t len, int k, long long offset, const unsigned char *nonce) {
+    (void)offset;
+    (void)nonce;
+    pthread_once(&kernels_selected, select_kernels);
+    table_encrypt(&inverse_tables[fold_key(k) - FOLDED_KEY_MIN], in, out, len);
+}
+
+// the offset only matters to stream ciphers
+static int shift_encrypt_char(int c, int k, long long offset, const unsigned char *nonce) {
+    (void)offset;
+    (void)nonce;
+    return shift_encrypt(c, k);
+}
+
+const struct cipher_engine shift_engine = {
+    .name = "shift",
+    .initial_key = 1,
+    .init = shift_init,
+    .on_reset = shift_on_reset,
+    .encrypt = shift_encrypt_char,
+    .encrypt_block = shift_encrypt_block,
+    .decrypt_block = shift_decrypt_block,
+    .count_block = count_lanes,
+};
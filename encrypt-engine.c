@@ -0,0 +1,97 @@
+#include "encrypt-engine.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+static const struct cipher_engine *engines[] = { &shift_engine, &caesar_engine, &aes_engine, &chacha_engine };
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+const struct cipher_engine *engine_find(const char *name) {
+    for (size_t i = 0; i < ENGINE_COUNT; i++) {
+        if (strcmp(engines[i]->name, name) == 0) {
+            return engines[i];
+        }
+    }
+    return NULL;
+}
+
+const char *engine_names() {
+    return "shift|caesar|aes|chacha";
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int engine_secret(unsigned char secret[32]) {
+    const char *hex = getenv("ENCRYPT_KEY");
+    if (!hex || strlen(hex) != 64) {
+        return 0;
+    }
+    for (int i = 0; i < 32; i++) {
+        int hi = hex_digit(hex[2 * i]), lo = hex_digit(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return 0;
+        }
+        secret[i] = hi << 4 | lo;
+    }
+    return 1;
+}
+
+int engine_nonce(unsigned char nonce[ENGINE_NONCE_SIZE]) {
+    // requests this small are never cut short once the pool is ready
+    ssize_t got;
+    while ((got = getrandom(nonce, ENGINE_NONCE_SIZE, 0)) < 0 && errno == EINTR) {
+    }
+    return got == ENGINE_NONCE_SIZE;
+}
+
+void ctr_xor(const char *in, char *out, size_t len, long long offset, int key, const unsigned char *nonce,
+             size_t block_size,
+             void (*keystream)(unsigned char *ks, unsigned long long first, size_t blocks, int key,
+                               const unsigned char *nonce)) {
+    _Alignas(64) unsigned char ks[CTR_BATCH];
+    unsigned long long block = offset / block_size;
+    size_t skip = offset % block_size; // keystream bytes before offset in the first block
+    while (len > 0) {
+        size_t blocks = (skip + len + block_size - 1) / block_size;
+        if (blocks > CTR_BATCH / block_size) {
+            blocks = CTR_BATCH / block_size;
+        }
+        keystream(ks, block, blocks, key, nonce);
+        size_t take = blocks * block_size - skip;
+        if (take > len) {
+            take = len;
+        }
+        for (size_t i = 0; i < take; i++) {
+            out[i] = in[i] ^ ks[skip + i];
+        }
+        in += take;
+        out += take;
+        len -= take;
+        block += blocks;
+        skip = 0;
+    }
+}
+
+void count_lanes(unsigned int lanes[COUNT_LANES][256], const char *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        lanes[0][p[i]]++;
+        lanes[1][p[i + 1]]++;
+        lanes[2][p[i + 2]]++;
+        lanes[3][p[i + 3]]++;
+        lanes[0][p[i + 4]]++;
+        lanes[1][p[i + 5]]++;
+        lanes[2][p[i + 6]]++;
+        lanes[3][p[i + 7]]++;
+    }
+    for (; i < len; i++) {
+        lanes[i & (COUNT_LANES - 1)][p[i]]++;
+    }
+}
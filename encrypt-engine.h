@@ -0,0 +1,81 @@
+#ifndef ENCRYPT_ENGINE_H
+#define ENCRYPT_ENGINE_H
+
+/* Cipher engines. An engine is the cipher applied to every block, the way its
+ * characters are counted and how the key moves on at a reset, picked by name
+ * at runtime. A new engine fills in a struct cipher_engine and is listed in
+ * encrypt-engine.c, the pipeline stays the same.
+ */
+
+#include <stddef.h>
+#include "encrypt-epoch.h"
+
+// bytes of the random nonce every file is encrypted under, see engine_nonce()
+#define ENGINE_NONCE_SIZE 12
+
+struct cipher_engine {
+    const char *name;
+    int initial_key;
+    // the keystream depends on the file nonce, its output can only be decrypted with the
+    // key index that keeps the nonce
+    int uses_nonce;
+    // prepares kernels and tables, safe to call more than once, returns 0 if the engine
+    // cannot be used
+    int (*init)();
+    // returns the key that follows key at a reset
+    int (*on_reset)(int key);
+    // offset is the position of the (first) character in the input and nonce the
+    // ENGINE_NONCE_SIZE bytes of its file, for stream ciphers. encrypt() gets c as a char
+    // value, like the characters of a block
+    int (*encrypt)(int c, int key, long long offset, const unsigned char *nonce);
+    void (*encrypt_block)(const char *in, char *out, size_t len, int key, long long offset, const unsigned char *nonce);
+    // undoes encrypt_block with the same key, offset and nonce. Exact for every character
+    // the cipher maps one to one: all but '~' of the printable range for shift, every
+    // character up to key 26 for caesar
+    void (*decrypt_block)(const char *in, char *out, size_t len, int key, long long offset, const unsigned char *nonce);
+    // adds every character of buf to the interleaved lanes
+    void (*count_block)(unsigned int lanes[COUNT_LANES][256], const char *buf, size_t len);
+};
+
+extern const struct cipher_engine shift_engine;  // printable range shift, the key goes up by 5
+extern const struct cipher_engine caesar_engine; // alphabetic Caesar counted in upper case, the key goes up by 1
+extern const struct cipher_engine aes_engine;    // AES-256-CTR, the key numbers the epoch
+extern const struct cipher_engine chacha_engine; // ChaCha20, the key numbers the epoch
+
+/* Returns the engine called name, NULL if there is none. */
+const struct cipher_engine *engine_find(const char *name);
+
+/* Names of all engines separated by '|', for usage messages. */
+const char *engine_names();
+
+/* Secret key of the stream cipher engines, taken from ENCRYPT_KEY as 64 hex
+ * digits. Returns 0 if it is missing or malformed.
+ */
+int engine_secret(unsigned char secret[32]);
+
+/* Fills nonce with ENGINE_NONCE_SIZE random bytes from getrandom(2), a new
+ * one for every file. Together with the key and the block number it makes the
+ * counter of the stream ciphers, so no two files share a keystream even with
+ * the same secret. Returns 0 if the kernel has no randomness to give.
+ */
+int engine_nonce(unsigned char nonce[ENGINE_NONCE_SIZE]);
+
+/* Counter mode for the stream cipher engines: XORs len characters at offset
+ * with the keystream. keystream() fills blocks keystream blocks of block_size
+ * bytes, starting with block number first, for the given key and file nonce.
+ * It is asked for at most CTR_BATCH bytes at a time, which has to be a
+ * multiple of block_size.
+ */
+#define CTR_BATCH 1024
+void ctr_xor(const char *in, char *out, size_t len, long long offset, int key, const unsigned char *nonce,
+             size_t block_size,
+             void (*keystream)(unsigned char *ks, unsigned long long first, size_t blocks, int key,
+                               const unsigned char *nonce));
+
+/* count_block of engines that count every character as itself. Consecutive
+ * characters go to different lanes, so a run of the same character does not
+ * make every increment wait for the previous one.
+ */
+void count_lanes(unsigned int lanes[COUNT_LANES][256], const char *buf, size_t len);
+
+#endif // ENCRYPT_ENGINE_H
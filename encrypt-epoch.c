@@ -0,0 +1,256 @@
+#include "encrypt-epoch.h"
+#include <limits.h>
+#include <string.h>
+
+// Marks sides as done with epoch, whoever completes both sides queues it for logging.
+// epoch_retire() finishes epochs ahead of the sides, so they may be queued out of order,
+// and a side passing an epoch that is logged already finds its set tagged for a later one.
+static void retire(struct epochs *e, int epoch, int sides) {
+    atomic_llong *retired = &e->sets[epoch % EPOCH_SETS].retired;
+    long long tag = (long long)epoch * 4, old = atomic_load(retired);
+    do {
+        if ((old & ~3LL) != tag || (old & sides) == sides) return;
+    } while (!atomic_compare_exchange_weak(retired, &old, old | sides));
+    if ((old | sides) == (tag | EPOCH_RETIRED_INPUT | EPOCH_RETIRED_OUTPUT)) {
+        sem_post(&e->finished);
+    }
+}
+
+// Waits until epoch is less than window epochs ahead of the last one logged. Once it has
+// to wait, it sleeps until a quarter of the window is free again rather than waking for
+// every epoch logged. The caller has finished every epoch before its own, so the logger
+// gets that far without it.
+static void wait_logged(struct epochs *e, int epoch, int window) {
+    if (epoch - atomic_load(&e->logged) < window) {
+        return;
+    }
+    pthread_mutex_lock(&e->logged_lock);
+    while (epoch - atomic_load(&e->logged) >= window) {
+        int wanted = epoch - window + 1 + window / 4;
+        if (wanted < e->logged_wanted) {
+            e->logged_wanted = wanted;
+        }
+        pthread_cond_wait(&e->logged_changed, &e->logged_lock);
+    }
+    pthread_mutex_unlock(&e->logged_lock);
+}
+
+static atomic_long epochs_made = 0;
+
+// a thread keeps its shard for as long as it counts into the same epochs
+static _Thread_local long thread_epochs = 0;
+static _Thread_local int thread_shard = -1;
+
+struct count_shard *epoch_shard(struct count_set *set) {
+    if (thread_epochs != set->epochs->id) {
+        thread_epochs = set->epochs->id;
+        // a shared shard would lose counts, its counters are not atomic
+        thread_shard = atomic_fetch_add(&set->epochs->shards_used, 1);
+    }
+    return thread_shard < set->epochs->shard_slots ? &set->shards[thread_shard] : NULL;
+}
+
+static int shard_count(struct count_set *set) {
+    int used = atomic_load(&set->epochs->shards_used);
+    return used < set->epochs->shard_slots ? used : set->epochs->shard_slots;
+}
+
+static void fold_lanes(long long counts[256], unsigned int lanes[COUNT_LANES][256]) {
+    for (int l = 0; l < COUNT_LANES; l++) {
+        for (int i = 0; i < 256; i++) {
+            counts[i] += lanes[l][i];
+        }
+    }
+    memset(lanes, 0, sizeof(unsigned int) * COUNT_LANES * 256);
+}
+
+void epoch_fold(struct count_shard *shard) {
+    fold_lanes(shard->input_counts, shard->input_lane_counts);
+    fold_lanes(shard->output_counts, shard->output_lane_counts);
+    shard->input_lane_total = 0;
+    shard->output_lane_total = 0;
+}
+
+static long long lane_sum(const unsigned int lanes[COUNT_LANES][256], int c) {
+    long long count = 0;
+    for (int l = 0; l < COUNT_LANES; l++) {
+        count += lanes[l][c];
+    }
+    return count;
+}
+
+long long epoch_input_count(struct count_set *set, int c) {
+    long long count = 0;
+    for (int s = 0; s < shard_count(set); s++) {
+        count += set->shards[s].input_counts[c] + lane_sum(set->shards[s].input_lane_counts, c);
+    }
+    return count;
+}
+
+long long epoch_output_count(struct count_set *set, int c) {
+    long long count = 0;
+    for (int s = 0; s < shard_count(set); s++) {
+        count += set->shards[s].output_counts[c] + lane_sum(set->shards[s].output_lane_counts, c);
+    }
+    return count;
+}
+
+long long epoch_input_total(struct count_set *set) {
+    long long total = 0;
+    for (int s = 0; s < shard_count(set); s++) {
+        total += set->shards[s].input_total_count;
+    }
+    return total;
+}
+
+long long epoch_output_total(struct count_set *set) {
+    long long total = 0;
+    for (int s = 0; s < shard_count(set); s++) {
+        total += set->shards[s].output_total_count;
+    }
+    return total;
+}
+
+// sums the shards into the counts of set
+static void reduce(struct count_set *set) {
+    for (int s = 0; s < shard_count(set); s++) {
+        struct count_shard *shard = &set->shards[s];
+        epoch_fold(shard);
+        for (int i = 0; i < 256; i++) {
+            set->input_counts[i] += shard->input_counts[i];
+            set->output_counts[i] += shard->output_counts[i];
+        }
+        set->input_total_count += shard->input_total_count;
+        set->output_total_count += shard->output_total_count;
+    }
+}
+
+// logs finished epochs in order and clears their sets for reuse
+static void *logger(void *arg) {
+    struct epochs *e = arg;
+    for (int epoch = 0;; epoch++) {
+        struct count_set *set = &e->sets[epoch % EPOCH_SETS];
+        // a post may be for a later epoch finished ahead, that one is found done in its turn
+        while (atomic_load(&set->retired) != ((long long)epoch * 4 | EPOCH_RETIRED_INPUT | EPOCH_RETIRED_OUTPUT)) {
+            sem_wait(&e->finished);
+            if (e->stopping) {
+                return NULL;
+            }
+        }
+        set->key = e->keys[epoch % EPOCH_KEYS];
+        set->epoch = epoch;
+        reduce(set);
+        e->log_set(e->owner, set);
+
+        // only shards some thread has touched need clearing
+        memset(set->shards, 0, sizeof(struct count_shard) * shard_count(set));
+        memset(set->input_counts, 0, sizeof(set->input_counts));
+        memset(set->output_counts, 0, sizeof(set->output_counts));
+        set->input_total_count = 0;
+        set->output_total_count = 0;
+        atomic_store(&set->retired, (long long)(epoch + EPOCH_SETS) * 4);
+        pthread_mutex_lock(&e->logged_lock);
+        atomic_store(&e->logged, epoch + 1);
+        if (epoch + 1 >= e->logged_wanted) {
+            e->logged_wanted = INT_MAX;
+            pthread_cond_broadcast(&e->logged_changed);
+        }
+        pthread_mutex_unlock(&e->logged_lock);
+    }
+    return NULL;
+}
+
+void epoch_init(struct epochs *e, struct count_set *sets, struct count_shard *shards, int shard_slots, int key,
+                void (*log_set)(void *owner, struct count_set *set), void *owner) {
+    e->sets = sets;
+    e->log_set = log_set;
+    e->owner = owner;
+    e->current_epoch = e->input_epoch = e->output_epoch = 0;
+    atomic_init(&e->logged, 0);
+    e->logged_wanted = INT_MAX;
+    e->stopping = 0;
+    e->shard_slots = shard_slots;
+    atomic_init(&e->shards_used, 0);
+    e->id = atomic_fetch_add(&epochs_made, 1) + 1;
+    for (int i = 0; i < EPOCH_SETS; i++) {
+        sets[i].epochs = e;
+        sets[i].shards = shards + i * shard_slots;
+        atomic_init(&sets[i].retired, (long long)i * 4);
+    }
+    e->keys[0] = key;
+    pthread_mutex_init(&e->logged_lock, NULL);
+    pthread_cond_init(&e->logged_changed, NULL);
+    sem_init(&e->finished, 0, 0);
+    pthread_create(&e->logger, NULL, &logger, e);
+}
+
+void epoch_destroy(struct epochs *e) {
+    // every epoch posted before this one was logged by epoch_finish()
+    e->stopping = 1;
+    sem_post(&e->finished);
+    pthread_join(e->logger, NULL);
+    sem_destroy(&e->finished);
+    pthread_cond_destroy(&e->logged_changed);
+    pthread_mutex_destroy(&e->logged_lock);
+}
+
+int epoch_begin(struct epochs *e, int key) {
+    int epoch = e->current_epoch + 1;
+    wait_logged(e, epoch, EPOCH_KEYS);
+    e->keys[epoch % EPOCH_KEYS] = key;
+    e->current_epoch = epoch;
+    return epoch;
+}
+
+void epoch_rekey(struct epochs *e, int key) {
+    e->keys[e->current_epoch % EPOCH_KEYS] = key;
+}
+
+struct count_set *epoch_count_input(struct epochs *e, int epoch) {
+    while (e->input_epoch < epoch) {
+        retire(e, e->input_epoch++, EPOCH_RETIRED_INPUT);
+        wait_logged(e, e->input_epoch, EPOCH_SETS);
+    }
+    return &e->sets[epoch % EPOCH_SETS];
+}
+
+struct count_set *epoch_count_output(struct epochs *e, int epoch) {
+    while (e->output_epoch < epoch) {
+        retire(e, e->output_epoch++, EPOCH_RETIRED_OUTPUT);
+        wait_logged(e, e->output_epoch, EPOCH_SETS);
+    }
+    return &e->sets[epoch % EPOCH_SETS];
+}
+
+struct count_set *epoch_set(struct epochs *e, int epoch) {
+    wait_logged(e, epoch, EPOCH_SETS);
+    return &e->sets[epoch % EPOCH_SETS];
+}
+
+void epoch_retire(struct epochs *e, int epoch) {
+    retire(e, epoch, EPOCH_RETIRED_INPUT | EPOCH_RETIRED_OUTPUT);
+}
+
+struct count_set *epoch_input_set(struct epochs *e) {
+    return &e->sets[e->input_epoch % EPOCH_SETS];
+}
+
+struct count_set *epoch_output_set(struct epochs *e) {
+    return &e->sets[e->output_epoch % EPOCH_SETS];
+}
+
+void epoch_finish(struct epochs *e) {
+    // the sides go through the rest together, one side run to the end first would wait for
+    // sets only the other side can free
+    while (e->input_epoch <= e->current_epoch || e->output_epoch <= e->current_epoch) {
+        int epoch = e->input_epoch < e->output_epoch ? e->input_epoch : e->output_epoch;
+        wait_logged(e, epoch, EPOCH_SETS);
+        if (e->input_epoch == epoch) {
+            retire(e, e->input_epoch++, EPOCH_RETIRED_INPUT);
+        }
+        if (e->output_epoch == epoch) {
+            retire(e, e->output_epoch++, EPOCH_RETIRED_OUTPUT);
+        }
+    }
+    wait_logged(e, e->current_epoch + 1, 1);
+}
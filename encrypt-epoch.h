@@ -0,0 +1,153 @@
+#ifndef ENCRYPT_EPOCH_H
+#define ENCRYPT_EPOCH_H
+
+/* Key epochs. Every reset starts a new epoch, and every span of a block belongs
+ * to the epoch it was read in. Each epoch being counted has its own set of
+ * counts, so counting threads move on to the next epoch's set when they reach
+ * its first span instead of waiting for the whole pipeline to drain. Once both
+ * the input and the output side are past an epoch, its set is logged by a
+ * background thread and then reused for a later epoch. The reader only keeps
+ * the keys of the epochs it begins, so it can run far ahead of the counting.
+ * All of that state lives in a struct epochs, one per pipeline, so pipelines
+ * count and log independently of each other.
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+// sets in rotation, counting waits when the epoch this many back is not logged yet
+#define EPOCH_SETS 64
+
+// keys of the epochs begun but not logged, the reader waits when it is this far ahead
+#define EPOCH_KEYS 16384
+
+// interleaved sub-histograms per side, folded into the counts before logging
+#define COUNT_LANES 4
+
+// most threads that may count into one set at the same time, each gets a shard of its
+// own; a struct epochs has only as many shards per set as it was given
+#define EPOCH_SHARDS 16
+
+// Counts of one thread, alone on its cache lines. The lanes are 32 bits wide to keep
+// them in cache and are folded into the 64-bit counts before they could overflow.
+struct count_shard {
+    _Alignas(64) long long input_counts[256];
+    long long output_counts[256];
+    unsigned int input_lane_counts[COUNT_LANES][256];
+    unsigned int output_lane_counts[COUNT_LANES][256];
+    unsigned int input_lane_total;  // characters in the input lanes since they were folded
+    unsigned int output_lane_total;
+    long long input_total_count;
+    long long output_total_count;
+};
+
+struct epochs;
+
+struct count_set {
+    struct count_shard *shards; // shard_slots of them
+    struct epochs *epochs;      // the rotation the set belongs to
+    // the shards reduced, filled in just before the set is logged
+    long long input_counts[256];
+    long long output_counts[256];
+    long long input_total_count;
+    long long output_total_count;
+    // filled in just before the set is logged too
+    int key;
+    int epoch;
+    // the epoch the set is for times 4, plus the EPOCH_RETIRED_* sides done counting it
+    atomic_llong retired;
+};
+
+#define EPOCH_RETIRED_INPUT 1
+#define EPOCH_RETIRED_OUTPUT 2
+
+struct epochs {
+    struct count_set *sets; // EPOCH_SETS of them
+    void (*log_set)(void *owner, struct count_set *set);
+    void *owner;            // passed to log_set
+
+    int current_epoch;      // latest epoch begun by the reader
+    int keys[EPOCH_KEYS];   // key of every epoch not logged yet
+    int input_epoch;        // epoch each side is counting
+    int output_epoch;
+    atomic_int logged;      // epochs logged so far, changed under logged_lock
+    int logged_wanted;      // least logged any waiter needs, INT_MAX with none waiting
+    pthread_mutex_t logged_lock;
+    pthread_cond_t logged_changed;
+    sem_t finished;         // one post per epoch both sides are done with, in any order
+    int shard_slots;        // shards per set, threads that may count
+    atomic_int shards_used; // shards handed out to threads so far
+    long id;                // tells apart epochs reusing the memory of earlier ones
+    int stopping;           // set by epoch_destroy(), ends the logger
+    pthread_t logger;
+};
+
+/* Starts the logger thread, which calls log_set(owner, set) for every
+ * finished epoch in order, and begins epoch 0. sets points at EPOCH_SETS
+ * zeroed sets and shards at EPOCH_SETS * shard_slots zeroed shards, one for
+ * each thread that will count, at most EPOCH_SHARDS.
+ */
+void epoch_init(struct epochs *e, struct count_set *sets, struct count_shard *shards, int shard_slots, int key,
+                void (*log_set)(void *owner, struct count_set *set), void *owner);
+
+/* Stops the logger thread. Call after epoch_finish(), or when nothing was
+ * counted.
+ */
+void epoch_destroy(struct epochs *e);
+
+/* Reader side: begins the next epoch with the given key, waiting while the
+ * epoch EPOCH_KEYS back is not logged yet. Returns the new epoch number.
+ */
+int epoch_begin(struct epochs *e, int key);
+
+/* Reader side: replaces the key of the current epoch before anything of it
+ * is read.
+ */
+void epoch_rekey(struct epochs *e, int key);
+
+/* Counting side: returns the set to count a span of the given epoch into,
+ * waiting while it still holds the epoch EPOCH_SETS back. Moving to a later
+ * epoch finishes the earlier ones for that side, so each side must get here
+ * in read order, one thread at a time.
+ */
+struct count_set *epoch_count_input(struct epochs *e, int epoch);
+struct count_set *epoch_count_output(struct epochs *e, int epoch);
+
+/* The set of an epoch that is not finished yet, without finishing anything,
+ * waiting like the functions above. For threads counting out of order, which
+ * rely on someone else calling those in read order once their blocks are
+ * counted.
+ */
+struct count_set *epoch_set(struct epochs *e, int epoch);
+
+/* Finishes epoch on both sides ahead of the sides' read order, for a thread
+ * that counted every character of it on both sides itself. Calling one of
+ * the side functions above past it later does no harm.
+ */
+void epoch_retire(struct epochs *e, int epoch);
+
+/* The calling thread's shard of set. At most shard_slots threads may count
+ * into one struct epochs over its life, NULL for any one more that asks.
+ */
+struct count_shard *epoch_shard(struct count_set *set);
+
+/* Folds the lanes of a shard into its counts. */
+void epoch_fold(struct count_shard *shard);
+
+/* Sums of the shards of set, lanes included. */
+long long epoch_input_count(struct count_set *set, int c);
+long long epoch_output_count(struct count_set *set, int c);
+long long epoch_input_total(struct count_set *set);
+long long epoch_output_total(struct count_set *set);
+
+/* The set each side is currently counting into. */
+struct count_set *epoch_input_set(struct epochs *e);
+struct count_set *epoch_output_set(struct epochs *e);
+
+/* Finishes every epoch begun so far on both sides and waits until all of them
+ * are logged. Call once after the last block.
+ */
+void epoch_finish(struct epochs *e);
+
+#endif // ENCRYPT_EPOCH_H
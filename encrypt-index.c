@@ -0,0 +1,108 @@
+#include "encrypt-index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void put_u32(unsigned char *p, unsigned int v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static unsigned int get_u32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+void index_encode(char *buf, const struct index_entry *e) {
+    unsigned char *p = (unsigned char *)buf;
+    put_u32(p, (unsigned long long)e->offset);
+    put_u32(p + 4, (unsigned long long)e->offset >> 32);
+    put_u32(p + 8, e->key);
+}
+
+void index_decode(const char *buf, struct index_entry *e) {
+    const unsigned char *p = (const unsigned char *)buf;
+    e->offset = (long long)((unsigned long long)get_u32(p + 4) << 32 | get_u32(p));
+    e->key = (int)get_u32(p + 8);
+}
+
+// reads all of len at offset, retrying short reads
+static int read_fully(int fd, char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t r = pread(fd, buf, len, offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return 0;
+        buf += r;
+        len -= r;
+        offset += r;
+    }
+    return 1;
+}
+
+int index_open(struct index_reader *r, const char *name) {
+    char header[INDEX_HEADER_SIZE];
+    struct stat st;
+    r->fd = open(name, O_RDONLY);
+    if (r->fd < 0) {
+        return 0;
+    }
+    if (fstat(r->fd, &st) != 0 || st.st_size < INDEX_HEADER_SIZE ||
+        !read_fully(r->fd, header, INDEX_HEADER_SIZE, 0) || memcmp(header, INDEX_MAGIC, INDEX_MAGIC_SIZE) != 0) {
+        index_close(r);
+        return 0;
+    }
+    // a record cut short by a crash is left out
+    memcpy(r->nonce, header + INDEX_MAGIC_SIZE, INDEX_NONCE_SIZE);
+    r->count = (st.st_size - INDEX_HEADER_SIZE) / INDEX_RECORD_SIZE;
+    r->first = 0;
+    r->loaded = 0;
+    return 1;
+}
+
+void index_close(struct index_reader *r) {
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    r->fd = -1;
+}
+
+int index_get(struct index_reader *r, long long i, struct index_entry *e) {
+    if (i < 0 || i >= r->count) {
+        return 0;
+    }
+    if (i < r->first || i >= r->first + r->loaded) {
+        char buf[INDEX_CHUNK * INDEX_RECORD_SIZE];
+        int records = r->count - i < INDEX_CHUNK ? r->count - i : INDEX_CHUNK;
+        if (!read_fully(r->fd, buf, (size_t)records * INDEX_RECORD_SIZE, INDEX_HEADER_SIZE + i * INDEX_RECORD_SIZE)) {
+            return 0;
+        }
+        for (int j = 0; j < records; j++) {
+            index_decode(buf + j * INDEX_RECORD_SIZE, &r->entries[j]);
+        }
+        r->first = i;
+        r->loaded = records;
+    }
+    *e = r->entries[i - r->first];
+    return 1;
+}
+
+long long index_find(struct index_reader *r, long long offset) {
+    struct index_entry e;
+    long long low = 0, high = r->count - 1, found = -1;
+    while (low <= high) {
+        long long mid = low + (high - low) / 2;
+        if (!index_get(r, mid, &e)) {
+            return -1;
+        }
+        if (e.offset <= offset) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
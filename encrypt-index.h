@@ -0,0 +1,61 @@
+#ifndef ENCRYPT_INDEX_H
+#define ENCRYPT_INDEX_H
+
+/* Key index, written next to the log with -i. It maps each input offset to
+ * the key it was encrypted with, so a byte range of the output can be
+ * decrypted without going through everything before it. The file starts with
+ * INDEX_MAGIC and the random nonce the job's file was encrypted under (see
+ * engine_nonce()), then holds one fixed-size record per epoch that has any
+ * characters: the input offset of its first character as a 64-bit and its key
+ * as a 32-bit little endian value. An epoch ends where the next record starts,
+ * the last one at the end of the input. The ciphertext is as long as the
+ * plaintext, so the offsets are the same in both.
+ */
+
+#include <stddef.h>
+
+#define INDEX_MAGIC "ENCX"
+#define INDEX_MAGIC_SIZE 4
+#define INDEX_NONCE_SIZE 12 // ENGINE_NONCE_SIZE
+#define INDEX_HEADER_SIZE (INDEX_MAGIC_SIZE + INDEX_NONCE_SIZE)
+#define INDEX_RECORD_SIZE 12
+
+// records a reader fetches from the file at once
+#define INDEX_CHUNK 512
+
+struct index_entry {
+    long long offset;
+    int key;
+};
+
+/* Encodes e into the INDEX_RECORD_SIZE bytes at buf. */
+void index_encode(char *buf, const struct index_entry *e);
+
+/* Decodes the record at buf into e. */
+void index_decode(const char *buf, struct index_entry *e);
+
+/* Reads an index in place with pread(2), a chunk of records at a time. */
+struct index_reader {
+    int fd;
+    long long count;  // records in the file
+    long long first;  // record held in entries[0]
+    int loaded;       // records held
+    unsigned char nonce[INDEX_NONCE_SIZE];
+    struct index_entry entries[INDEX_CHUNK];
+};
+
+/* Opens the index called name and reads its nonce, returns 0 if it cannot be
+ * read or is not an index.
+ */
+int index_open(struct index_reader *r, const char *name);
+void index_close(struct index_reader *r);
+
+/* Fetches record i into e, returns 0 past the last record. */
+int index_get(struct index_reader *r, long long i, struct index_entry *e);
+
+/* The last record starting at or before offset, found by binary search, that
+ * is the epoch holding offset. Returns -1 if the index has no such record.
+ */
+long long index_find(struct index_reader *r, long long offset);
+
+#endif // ENCRYPT_INDEX_H
@@ -0,0 +1,78 @@
+/*
+ * Converts a binary log written with encrypt -b back into the text layout of
+ * the regular log file.
+ *
+ * Usage: $./encrypt-logdecode binary_log [text_log]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encrypt-binlog.h"
+
+static void print_counts(FILE *out, const char *title, const long long counts[256]) {
+    fprintf(out, "%s: [ %lld", title, counts[0]);
+    for (int i = 1; i < 256; i++) {
+        fprintf(out, ", %lld", counts[i]);
+    }
+    fprintf(out, "]\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        printf("Usage: encrypt-logdecode binary_log [text_log]\n");
+        exit(1);
+    }
+    FILE *in = fopen(argv[1], "rb");
+    FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+    if (!in || !out) {
+        printf("Error: Could not open the log files\n");
+        exit(1);
+    }
+
+    // the log is small next to the data it describes, read it whole
+    size_t size = 0, capacity = 1 << 16;
+    char *buf = malloc(capacity);
+    size_t got;
+    while (buf && (got = fread(buf + size, 1, capacity - size, in)) > 0) {
+        size += got;
+        if (size == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+        }
+    }
+    if (!buf) {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    int decrypting = size >= BINLOG_MAGIC_SIZE && memcmp(buf, BINLOG_MAGIC_DECRYPT, BINLOG_MAGIC_SIZE) == 0;
+    if (size < BINLOG_MAGIC_SIZE || (!decrypting && memcmp(buf, BINLOG_MAGIC, BINLOG_MAGIC_SIZE) != 0)) {
+        printf("Error: %s is not a binary log\n", argv[1]);
+        exit(1);
+    }
+    // a decrypting run (-D) reads ciphertext and writes plaintext
+    const char *input_title = decrypting ? "Ciphertext frequency counts" : "Plaintext frequency counts";
+    const char *output_title = decrypting ? "Plaintext frequency counts" : "Ciphertext frequency counts";
+
+    struct binlog_entry e;
+    size_t offset = BINLOG_MAGIC_SIZE;
+    while (offset < size) {
+        size_t used = binlog_decode(buf + offset, size - offset, &e);
+        if (used == 0) {
+            printf("Error: Truncated entry at offset %zu\n", offset);
+            exit(1);
+        }
+        offset += used;
+        fprintf(out, "Counts using key %d:\n", e.key);
+        fprintf(out, "Total input count: %lld\n", e.input_total_count);
+        print_counts(out, input_title, e.input_counts);
+        fprintf(out, "Total output count: %lld\n", e.output_total_count);
+        print_counts(out, output_title, e.output_counts);
+        fprintf(out, "\n");
+    }
+
+    free(buf);
+    fclose(in);
+    if (out != stdout) fclose(out);
+    return 0;
+}
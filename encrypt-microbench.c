@@ -0,0 +1,334 @@
+/*
+ * Micro-benchmarks and cross-checks for the kernels behind encrypt-module.h.
+ *
+ * Every engine's encrypt(), encrypt_block(), count_input(), count_output(),
+ * their block variants and encrypt_count_block() run alone on a buffer that
+ * stays in L1, warmed up first, and the best of several rounds is reported
+ * in cycles per byte (TSC cycles on x86, nanoseconds elsewhere). log_counts()
+ * is timed last, per epoch. Before that each engine is checked against a
+ * plain reference: all 256 byte values under keys covering every residue mod
+ * 94 several times over, at every alignment and tail length the vector
+ * kernels have, through both the per-character and the block functions.
+ *
+ * Usage: ENCRYPT_SIMD=<kernel> ./encrypt-microbench (make microbench runs every kernel)
+ * Exits with 1 if any check fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "encrypt-module.h"
+#include "encrypt-engine.h"
+#include "encrypt-bench.h"
+
+// bytes per timed call, small enough to stay in L1 together with the output
+#define BUFFER_SIZE 8192
+// bytes processed per round and rounds per kernel, the fastest round counts
+#define ROUND_BYTES (8 << 20)
+#define ROUNDS 5
+// epochs counted before log_counts() is timed, a few less than the epoch sets in rotation
+#define LOG_EPOCHS 60
+#define RESET_INTERVAL 200
+
+// keys checked, every residue mod 94 about ten times including negative keys
+#define CHECK_KEY_MIN -470
+#define CHECK_KEY_MAX 470
+
+static char input[BUFFER_SIZE + 64];
+static char output[BUFFER_SIZE + 64];
+static int failures = 0;
+static struct encrypt_ctx *ctx;
+// the file nonce of the job the checks run in
+static const unsigned char *nonce;
+
+// nothing to stop on a reset here either
+void reset_requested(struct encrypt_ctx *ctx) {
+    (void)ctx;
+}
+
+void reset_finished(struct encrypt_ctx *ctx) {
+    (void)ctx;
+}
+
+static unsigned long long cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return bench_now();
+#endif
+}
+
+/* references, on characters as char the way the kernels read them */
+
+static int shift_reference(char c, int k) {
+    return (char)((c + k - 32) % 94 + 32);
+}
+
+static int caesar_reference(char c, int k) {
+    int x = c;
+    if (x >= 'a' && x <= 'z') {
+        x += k;
+        if (x > 'z') x = x - 'z' + 'a' - 1;
+    } else if (x >= 'A' && x <= 'Z') {
+        x += k;
+        if (x > 'Z') x = x - 'Z' + 'A' - 1;
+    }
+    return (char)x;
+}
+
+// the slot a character is counted in
+static int count_slot(const char *engine, unsigned char c) {
+    return strcmp(engine, "caesar") == 0 ? toupper(c) : c;
+}
+
+static void fail(const char *engine, const char *what, int k, int c, int got, int want) {
+    if (failures++ < 10) {
+        printf("FAIL %s %s key %d char %d: got %d, want %d\n", engine, what, k, c, got, want);
+    }
+}
+
+// the 256 byte values, starting at first and wrapping
+static void all_bytes(char *buf, int first) {
+    for (int i = 0; i < 256; i++) {
+        buf[i] = (char)(first + i);
+    }
+}
+
+static void check_cipher(const char *engine, int (*reference)(char, int)) {
+    char in[256 + 64], out[256 + 64], again[256 + 64];
+    // encrypt() works with the module's current key
+    for (int c = 0; c < 256; c++) {
+        int want = (unsigned char)reference((char)c, get_key(ctx));
+        int got = encrypt(ctx, c);
+        if (got != want) fail(engine, "encrypt", get_key(ctx), c, got, want);
+    }
+    for (int k = CHECK_KEY_MIN; k <= CHECK_KEY_MAX; k++) {
+        all_bytes(in, k);
+        for (int c = 0; c < 256; c++) {
+            char ch = (char)c;
+            int want = (unsigned char)reference(ch, k);
+            encrypt_block(ctx, &ch, out, 1, k, 0, nonce);
+            if ((unsigned char)out[0] != want) fail(engine, "encrypt_block", k, c, (unsigned char)out[0], want);
+        }
+        // every start alignment and tail of the vector kernels
+        for (int skew = 0; skew < 64; skew += 7) {
+            memcpy(again + skew, in, 256);
+            for (int len = 256 - 63; len <= 256; len += 9) {
+                encrypt_block(ctx, again + skew, out + (63 - skew), len, k, 0, nonce);
+                for (int i = 0; i < len; i++) {
+                    int want = (unsigned char)reference(in[i], k);
+                    if ((unsigned char)out[63 - skew + i] != want) {
+                        fail(engine, "encrypt_block tail", k, (unsigned char)in[i], (unsigned char)out[63 - skew + i], want);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// decrypt_block() has to give back every character in first..last that encrypt_block()
+// was given, with keys 0 to max_key
+static void check_decrypt(const char *engine, int first, int last, int max_key) {
+    char in[256], out[256], back[256];
+    int len = last - first + 1;
+    for (int i = 0; i < len; i++) {
+        in[i] = (char)(first + i);
+    }
+    for (int k = 0; k <= max_key; k++) {
+        encrypt_block(ctx, in, out, len, k, 0, nonce);
+        decrypt_block(ctx, out, back, len, k, 0, nonce);
+        for (int i = 0; i < len; i++) {
+            if (back[i] != in[i]) fail(engine, "decrypt_block", k, (unsigned char)in[i], (unsigned char)back[i], (unsigned char)in[i]);
+        }
+    }
+}
+
+// the counter mode engines were checked against openssl when they were written, here
+// they only have to decrypt what they encrypt however the input is split up, and
+// another file nonce has to give another keystream
+static void check_stream(const char *engine) {
+    char in[1024], out[1024], back[1024], other[1024];
+    unsigned char other_nonce[ENGINE_NONCE_SIZE];
+    for (int i = 0; i < 1024; i++) {
+        in[i] = (char)(i * 7);
+    }
+    for (int k = 0; k < 94; k++) {
+        for (long long offset = 0; offset < 200; offset += 13) {
+            encrypt_block(ctx, in, out, sizeof(in), k, offset, nonce);
+            // any split gives the same keystream
+            decrypt_block(ctx, out, back, 333, k, offset, nonce);
+            decrypt_block(ctx, out + 333, back + 333, sizeof(in) - 333, k, offset + 333, nonce);
+            for (int i = 0; i < 1024; i++) {
+                if (back[i] != in[i]) fail(engine, "decrypt", k, (unsigned char)in[i], (unsigned char)back[i], (unsigned char)in[i]);
+            }
+        }
+        memcpy(other_nonce, nonce, ENGINE_NONCE_SIZE);
+        other_nonce[ENGINE_NONCE_SIZE - 1] ^= 1;
+        encrypt_block(ctx, in, out, sizeof(in), k, 0, nonce);
+        encrypt_block(ctx, in, other, sizeof(in), k, 0, other_nonce);
+        if (memcmp(out, other, sizeof(out)) == 0) fail(engine, "nonce", k, 0, 0, 0);
+    }
+}
+
+static void check_counts(const char *engine) {
+    int epoch = get_epoch(ctx);
+    long long before_in[256], before_out[256], want_in[256] = {0}, want_out[256] = {0};
+    char in[512], out[512];
+    for (int c = 0; c < 256; c++) {
+        before_in[c] = get_input_count(ctx, c);
+        before_out[c] = get_output_count(ctx, c);
+    }
+    all_bytes(in, 0);
+    all_bytes(in + 256, 0);
+    encrypt_block(ctx, in, out, 256, 3, 0, nonce);
+    for (int i = 0; i < 256; i++) {
+        want_in[count_slot(engine, in[i])] += 3;
+        want_out[count_slot(engine, out[i])] += 3;
+    }
+    count_input_block(ctx, in, 256, epoch);
+    count_output_block(ctx, out, 256, epoch);
+    for (int i = 0; i < 256; i++) {
+        count_input(ctx, (unsigned char)in[i]);
+        count_output(ctx, (unsigned char)out[i]);
+    }
+    // the fused pass counts into a shard that every getter sums up as well
+    encrypt_count_block(ctx, in, out + 256, 256, 3, 0, nonce, epoch);
+    for (int c = 0; c < 256; c++) {
+        if (get_input_count(ctx, c) - before_in[c] != want_in[c]) {
+            fail(engine, "input count", 3, c, (int)(get_input_count(ctx, c) - before_in[c]), (int)want_in[c]);
+        }
+        if (get_output_count(ctx, c) - before_out[c] != want_out[c]) {
+            fail(engine, "output count", 3, c, (int)(get_output_count(ctx, c) - before_out[c]), (int)want_out[c]);
+        }
+    }
+    if (memcmp(out, out + 256, 256) != 0) {
+        fail(engine, "encrypt_count_block", 3, 0, 0, 0);
+    }
+}
+
+// prints the best of ROUNDS rounds of calls, each call covering bytes characters
+static void report(const char *engine, const char *kernel, unsigned long long best, long long bytes) {
+    printf("%-7s %-20s %8.3f %s/byte\n", engine, kernel, (double)best / bytes,
+#if defined(__x86_64__) || defined(__i386__)
+           "cycles"
+#else
+           "ns"
+#endif
+    );
+}
+
+#define TIME(engine, kernel, bytes_per_call, call)                           \
+    do {                                                                     \
+        long long calls = ROUND_BYTES / (bytes_per_call);                    \
+        unsigned long long best = ~0ULL;                                     \
+        for (int round = 0; round <= ROUNDS; round++) {                      \
+            unsigned long long start = cycles();                             \
+            for (long long n = 0; n < calls; n++) {                          \
+                call;                                                        \
+            }                                                                \
+            unsigned long long spent = cycles() - start;                     \
+            /* round 0 only warms up */                                      \
+            if (round > 0 && spent < best) best = spent;                     \
+        }                                                                    \
+        report(engine, kernel, best, calls * (long long)(bytes_per_call));   \
+    } while (0)
+
+static void time_kernels(const char *engine) {
+    int epoch = get_epoch(ctx);
+    volatile int sink = 0;
+    TIME(engine, "encrypt", BUFFER_SIZE,
+         for (int i = 0; i < BUFFER_SIZE; i++) sink += encrypt(ctx, (unsigned char)input[i]));
+    TIME(engine, "encrypt_block", BUFFER_SIZE, encrypt_block(ctx, input, output, BUFFER_SIZE, 7, 0, nonce));
+    TIME(engine, "encrypt_block 200", RESET_INTERVAL, encrypt_block(ctx, input, output, RESET_INTERVAL, 7, 0, nonce));
+    TIME(engine, "decrypt_block", BUFFER_SIZE, decrypt_block(ctx, input, output, BUFFER_SIZE, 7, 0, nonce));
+    TIME(engine, "count_input", BUFFER_SIZE,
+         for (int i = 0; i < BUFFER_SIZE; i++) count_input(ctx, (unsigned char)input[i]));
+    TIME(engine, "count_output", BUFFER_SIZE,
+         for (int i = 0; i < BUFFER_SIZE; i++) count_output(ctx, (unsigned char)output[i]));
+    TIME(engine, "count_input_block", BUFFER_SIZE, count_input_block(ctx, input, BUFFER_SIZE, epoch));
+    TIME(engine, "count_output_block", BUFFER_SIZE, count_output_block(ctx, output, BUFFER_SIZE, epoch));
+    TIME(engine, "encrypt_count_block", BUFFER_SIZE, encrypt_count_block(ctx, input, output, BUFFER_SIZE, 7, 0, nonce, epoch));
+    (void)sink;
+}
+
+// counts LOG_EPOCHS epochs on the input side only, so none can be logged before
+// log_counts() finishes the output side and waits for all of them
+static void time_log_counts(const char *path) {
+    char block[RESET_INTERVAL];
+    for (int e = 0; e < LOG_EPOCHS; e++) {
+        int len = read_input_block(ctx, block, RESET_INTERVAL);
+        count_input_block(ctx, block, len, get_epoch(ctx));
+    }
+    unsigned long long start = cycles();
+    log_counts(ctx);
+    unsigned long long spent = cycles() - start;
+    printf("%-7s %-20s %8.0f %s/epoch\n", "-", "log_counts", (double)spent / (get_epoch(ctx) + 1),
+#if defined(__x86_64__) || defined(__i386__)
+           "cycles"
+#else
+           "ns"
+#endif
+    );
+    encrypt_ctx_free(ctx);
+    remove(path);
+}
+
+int main() {
+    static const char *engines[] = {"shift", "caesar", "aes", "chacha"};
+    const char *simd = getenv("ENCRYPT_SIMD");
+    printf("ENCRYPT_SIMD=%s\n", simd ? simd : "");
+
+    // the input for the log_counts() round, read through the module as the pipeline does
+    char path[] = "/tmp/encrypt-microbench-XXXXXX";
+    FILE *f = fdopen(mkstemp(path), "w");
+    srand(1);
+    for (int i = 0; i < (LOG_EPOCHS + 1) * RESET_INTERVAL; i++) {
+        fputc(rand() & 255, f);
+    }
+    fclose(f);
+    ctx = encrypt_ctx_new(NULL);
+    if (!ctx) {
+        return 1;
+    }
+    if (!init(ctx, path, "/dev/null", "/dev/null")) {
+        fprintf(stderr, "Error: %s\n", encrypt_ctx_error(ctx));
+        return 1;
+    }
+    nonce = get_nonce(ctx);
+
+    for (int i = 0; i < BUFFER_SIZE + 64; i++) {
+        input[i] = (char)rand();
+    }
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        if (!select_engine(ctx, engines[e])) {
+            printf("%-7s skipped, no ENCRYPT_KEY\n", engines[e]);
+            continue;
+        }
+        if (strcmp(engines[e], "shift") == 0) {
+            check_cipher(engines[e], shift_reference);
+            // ' ' and '~' share an image, the rest of the printable range goes back
+            check_decrypt(engines[e], ' ', '}', 1000);
+        } else if (strcmp(engines[e], "caesar") == 0) {
+            check_cipher(engines[e], caesar_reference);
+            // from key 27 on letters can wrap onto other characters
+            check_decrypt(engines[e], 0, 255, 26);
+        } else {
+            check_stream(engines[e]);
+        }
+        check_counts(engines[e]);
+        time_kernels(engines[e]);
+    }
+    select_engine(ctx, "shift");
+    time_log_counts(path);
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -1,4 +1,7 @@
 #include "encrypt-module.h"
+#include "encrypt-epoch.h"
+#include "encrypt-engine.h"
+#include "encrypt-arena.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -12,98 +15,425 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#define RESET_INTERVAL 200
+// the reader must stay fewer than EPOCH_KEYS epochs ahead of what it has not handed on
+#define MAX_BLOCK_SPANS (EPOCH_KEYS / 2)
+#define JOB_SLOTS EPOCH_SETS
+#define LOG_ENTRY_SIZE 1024
+struct encrypt_ctx {
+void *owner;
+struct arena arena;
+struct epochs epochs;
 FILE *input_file;
 FILE *output_file;
-int input_counts[256];
-int output_counts[256];
-int input_total_count;
-int output_total_count;
-int key = 1;
-int read_count = 0;
-sem_t *sem_char_read;
-void clear_counts() {
-memset(input_counts, 0, sizeof(input_counts));
-memset(output_counts, 0, sizeof(output_counts));
-input_total_count = 0;
-output_total_count = 0;
-}
-void *not_random_reset() {
-while (1) {
-sem_wait(sem_char_read);
-read_count++;
-if (read_count == 200) {
-reset_requested();
-key++;
-clear_counts();
-reset_finished();
-read_count = 0;
-}
-}
-}
-void init(char *inputFileName, char *outputFileName, char *logFileName) {
-pthread_t pid;
-sem_char_read = sem_open("/sem_char_read", O_CREAT, 0644, 0);
-sem_unlink("/sem_char_read");
-pthread_create(&pid, NULL, &not_random_reset, NULL);
-input_file = fopen(inputFileName, "r");
-output_file = fopen(outputFileName, "w");
-}
-int read_input() {
-sem_post(sem_char_read);
-usleep(10000);
-return fgetc(input_file);
-}
-void write_output(int c) {
-fputc(c, output_file);
-}
-int encrypt(int c) {
-if (c >= 'a' && c <= 'z') {
-c += key;
-if (c > 'z') {
-c = c - 'z' + 'a' - 1;
-}
-} else if (c >= 'A' && c <= 'Z') {
-c += key;
-if (c > 'Z') {
-c = c - 'Z' + 'A' - 1;
+// the counts go to stdout, or to stderr once stdout carries the output
+FILE *log_stream;
+const struct cipher_engine *engine;
+int key;
+int count_threads;
+int epoch;
+long long read_offset;
+long long block_offset;
+long long encrypt_offset;
+// resets fall on fixed input offsets, k * RESET_INTERVAL, so the output does not depend on timing
+long long next_reset;
+int reset_pending;
+// spans of the block read last, a block may go on over max_spans epochs
+struct block_span *spans;
+int span_count;
+int max_spans;
+// outputs of the jobs init() opened, the writer moves through them with finish_output()
+FILE *outputs[JOB_SLOTS];
+// the stream ciphers encrypt each job's file under a random nonce of its own
+unsigned char nonces[JOB_SLOTS][ENGINE_NONCE_SIZE];
+int jobs_opened;
+int output_job;
+sem_t free_jobs;
+char log_entry[LOG_ENTRY_SIZE];
+char error[PATH_MAX + 64];
+};
+struct encrypt_ctx *encrypt_ctx_new(void *owner) {
+struct encrypt_ctx *ctx = calloc(1, sizeof(struct encrypt_ctx));
+if (!ctx) {
+return NULL;
 }
+ctx->owner = owner;
+arena_init(&ctx->arena);
+ctx->engine = &caesar_engine;
+ctx->key = 1;
+ctx->count_threads = 2;
+ctx->next_reset = RESET_INTERVAL;
+ctx->max_spans = 1;
+return ctx;
 }
+void encrypt_ctx_free(struct encrypt_ctx *ctx) {
+if (ctx->jobs_opened > 0) {
+epoch_destroy(&ctx->epochs);
+sem_destroy(&ctx->free_jobs);
+}
+if (ctx->input_file && ctx->input_file != stdin) {
+fclose(ctx->input_file);
+}
+arena_destroy(&ctx->arena);
+free(ctx);
+}
+void *encrypt_ctx_owner(struct encrypt_ctx *ctx) {
+return ctx->owner;
+}
+struct arena *encrypt_ctx_arena(struct encrypt_ctx *ctx) {
+return &ctx->arena;
+}
+const char *encrypt_ctx_error(struct encrypt_ctx *ctx) {
+return ctx->error;
+}
+static int append_counts(struct encrypt_ctx *ctx, int len, const long long counts[256]) {
+for (int c = 'A'; c <= 'Z'; c++) {
+len += snprintf(ctx->log_entry + len, LOG_ENTRY_SIZE - len, "%c:%lld ", c, counts[c]);
+}
+return len + snprintf(ctx->log_entry + len, LOG_ENTRY_SIZE - len, "\n");
+}
+// formats the whole entry first so it goes out in one piece, the log stays on stdio
+// since the driver prints through it too
+static void log_set(void *owner, struct count_set *set) {
+struct encrypt_ctx *ctx = owner;
+int len = snprintf(ctx->log_entry, LOG_ENTRY_SIZE, "Total input count with current key is %lld.\n", set->input_total_count);
+len = append_counts(ctx, len, set->input_counts);
+len += snprintf(ctx->log_entry + len, LOG_ENTRY_SIZE - len, "Total output count with current key is %lld.\n", set->output_total_count);
+len = append_counts(ctx, len, set->output_counts);
+fwrite(ctx->log_entry, 1, len, ctx->log_stream);
+fflush(ctx->log_stream);
+}
+// nothing of a job init() cannot go on with stays open, the next init() may try another
+static int abandon_job(struct encrypt_ctx *ctx, FILE *input, FILE *output) {
+if (input && input != stdin) {
+fclose(input);
+}
+if (output && output != stdout) {
+fclose(output);
+}
+if (ctx->jobs_opened > 0) {
+sem_post(&ctx->free_jobs);
+}
+return 0;
+}
+int init(struct encrypt_ctx *ctx, char *inputFileName, char *outputFileName, char *logFileName) {
+(void)logFileName;
+if (ctx->jobs_opened > 0) {
+// the next job of a batch reads from the start with the initial key, in an epoch of its own
+if (ctx->input_file && ctx->input_file != stdin) {
+fclose(ctx->input_file);
+}
+ctx->input_file = NULL;
+ctx->read_offset = ctx->block_offset = ctx->encrypt_offset = 0;
+ctx->next_reset = RESET_INTERVAL;
+ctx->reset_pending = 0;
+while (sem_wait(&ctx->free_jobs) != 0 && errno == EINTR) {
+}
+}
+FILE *input = strcmp(inputFileName, "-") == 0 ? stdin : fopen(inputFileName, "r");
+FILE *output = !input ? NULL : strcmp(outputFileName, "-") == 0 ? stdout : fopen(outputFileName, "w");
+if (!output) {
+snprintf(ctx->error, sizeof(ctx->error), "%s: %s", !input ? inputFileName : outputFileName, strerror(errno));
+return abandon_job(ctx, input, output);
+}
+if (!engine_nonce(ctx->nonces[ctx->jobs_opened % JOB_SLOTS])) {
+snprintf(ctx->error, sizeof(ctx->error), "No random nonce for %s", inputFileName);
+return abandon_job(ctx, input, output);
+}
+if (ctx->jobs_opened == 0) {
+struct count_set *sets = arena_alloc(&ctx->arena, sizeof(struct count_set) * EPOCH_SETS, -1);
+struct count_shard *shards = arena_alloc(&ctx->arena, sizeof(struct count_shard) * EPOCH_SETS * ctx->count_threads, -1);
+ctx->spans = arena_alloc(&ctx->arena, sizeof(struct block_span) * ctx->max_spans, -1);
+if (!sets || !shards || !ctx->spans) {
+snprintf(ctx->error, sizeof(ctx->error), "Memory allocation failed");
+return abandon_job(ctx, input, output);
+}
+ctx->output_file = output;
+ctx->log_stream = ctx->output_file == stdout ? stderr : stdout;
+sem_init(&ctx->free_jobs, 0, JOB_SLOTS - 1);
+ctx->engine->init();
+ctx->key = ctx->engine->initial_key;
+epoch_init(&ctx->epochs, sets, shards, ctx->count_threads, ctx->key, log_set, ctx);
+} else {
+ctx->key = ctx->engine->initial_key;
+ctx->epoch = epoch_begin(&ctx->epochs, ctx->key);
+}
+ctx->input_file = input;
+ctx->outputs[ctx->jobs_opened % JOB_SLOTS] = output;
+ctx->jobs_opened++;
+return 1;
+}
+int block_spans(struct encrypt_ctx *ctx, int len) {
+(void)ctx;
+int spans = len / RESET_INTERVAL + 1;
+return spans < MAX_BLOCK_SPANS ? spans : MAX_BLOCK_SPANS;
+}
+int block_reach(int len) {
+if (len <= RESET_INTERVAL) {
+return len;
+}
+int spans = len / RESET_INTERVAL;
+return (spans < MAX_BLOCK_SPANS ? spans : MAX_BLOCK_SPANS) * RESET_INTERVAL;
+}
+int set_block_spans(struct encrypt_ctx *ctx, int spans) {
+if (spans < 1 || spans > MAX_BLOCK_SPANS || ctx->jobs_opened > 0) {
+return 0;
+}
+ctx->max_spans = spans;
+return 1;
+}
+int set_count_threads(struct encrypt_ctx *ctx, int threads) {
+if (threads < 1 || threads > EPOCH_SHARDS || ctx->jobs_opened > 0) {
+return 0;
+}
+ctx->count_threads = threads;
+return 1;
+}
+int select_engine(struct encrypt_ctx *ctx, const char *name) {
+const struct cipher_engine *e = engine_find(name);
+if (!e || !e->init()) {
+return 0;
+}
+ctx->engine = e;
+return 1;
+}
+static void wait_for_reset(struct encrypt_ctx *ctx) {
+if (ctx->reset_pending) {
+reset_requested(ctx);
+ctx->key = ctx->engine->on_reset(ctx->key);
+ctx->epoch = epoch_begin(&ctx->epochs, ctx->key);
+reset_finished(ctx);
+ctx->reset_pending = 0;
+}
+}
+// splits the block into one span per epoch, doing the resets between them
+static void end_block(struct encrypt_ctx *ctx, int got) {
+int ended = got == 0;
+ctx->block_offset = ctx->read_offset;
+ctx->span_count = 0;
+for (;;) {
+long long room = ctx->next_reset - ctx->read_offset;
+int length = got < room ? got : room;
+struct block_span *span = &ctx->spans[ctx->span_count++];
+span->length = length;
+span->key = ctx->key;
+span->epoch = ctx->epoch;
+span->whole = length == RESET_INTERVAL;
+span->last = length == room || ended;
+ctx->read_offset += length;
+got -= length;
+if (ctx->read_offset == ctx->next_reset) {
+ctx->next_reset += RESET_INTERVAL;
+ctx->reset_pending = 1;
+}
+if (got == 0) {
+break;
+}
+wait_for_reset(ctx);
+}
+}
+int read_input(struct encrypt_ctx *ctx) {
+wait_for_reset(ctx);
+int c = fgetc(ctx->input_file);
+end_block(ctx, c != EOF);
 return c;
 }
-void count_input(int c) {
-input_counts[toupper(c)]++;
-input_total_count++;
-}
-void count_output(int c) {
-output_counts[toupper(c)]++;
-output_total_count++;
-}
-int get_input_count(int c) {
-return input_counts[toupper(c)];
-}
-int get_output_count(int c) {
-return output_counts[toupper(c)];
-}
-int get_input_total_count() {
-return input_total_count;
-}
-int get_output_total_count() {
-return output_total_count;
-}
-void log_counts() {
-    printf("Total input count with current key is %d.\n", input_total_count);
-    
-    // Print input character counts
-    for (char c = 'A'; c <= 'Z'; c++) {
-        printf("%c:%d ", c, input_counts[c]);
-    }
-    printf("\n");
-    
-    printf("Total output count with current key is %d.\n", output_total_count);
-    
-    // Print output character counts
-    for (char c = 'A'; c <= 'Z'; c++) {
-        printf("%c:%d ", c, output_counts[c]);
-    }
-    printf("\n");
-}
\ No newline at end of file
+int input_mapped(struct encrypt_ctx *ctx) {
+(void)ctx;
+return 0;
+}
+int read_input_view(struct encrypt_ctx *ctx, const char **block, int len) {
+(void)ctx;
+(void)block;
+(void)len;
+return 0;
+}
+// a block from the start of an epoch may go on over max_spans whole epochs
+int read_input_block(struct encrypt_ctx *ctx, char *buf, int len) {
+wait_for_reset(ctx);
+long long room = ctx->next_reset - ctx->read_offset;
+if (len > room && room == RESET_INTERVAL) {
+int spans = len / RESET_INTERVAL;
+len = (spans < ctx->max_spans ? spans : ctx->max_spans) * RESET_INTERVAL;
+} else if (len > room) {
+len = room;
+}
+int got = fread(buf, 1, len, ctx->input_file);
+end_block(ctx, got);
+return got;
+}
+void write_output(struct encrypt_ctx *ctx, int c) {
+fputc(c, ctx->output_file);
+}
+void write_output_block(struct encrypt_ctx *ctx, const char *buf, size_t len) {
+fwrite(buf, 1, len, ctx->output_file);
+}
+void write_output_blocks(struct encrypt_ctx *ctx, const struct iovec *blocks, int count) {
+for (int i = 0; i < count; i++) {
+write_output_block(ctx, blocks[i].iov_base, blocks[i].iov_len);
+}
+}
+int enable_binary_log(struct encrypt_ctx *ctx) {
+(void)ctx;
+return 0;
+}
+int enable_key_index(struct encrypt_ctx *ctx) {
+(void)ctx;
+return 0;
+}
+// there is no key index here, so the stream ciphers are refused
+int needs_key_index(struct encrypt_ctx *ctx) {
+return ctx->engine->uses_nonce;
+}
+int enable_decrypt(struct encrypt_ctx *ctx, const char *index_name) {
+(void)ctx;
+(void)index_name;
+return 0;
+}
+int seek_input(struct encrypt_ctx *ctx, long long offset, long long length) {
+(void)ctx;
+(void)offset;
+(void)length;
+return 0;
+}
+int enable_direct_output(struct encrypt_ctx *ctx) {
+(void)ctx;
+return 0;
+}
+int flush_output(struct encrypt_ctx *ctx) {
+fflush(ctx->output_file);
+return 1;
+}
+void finish_output(struct encrypt_ctx *ctx) {
+fflush(ctx->output_file);
+if (ctx->output_file && ctx->output_file != stdout) {
+fclose(ctx->output_file);
+}
+ctx->output_job++;
+ctx->output_file = ctx->outputs[ctx->output_job % JOB_SLOTS];
+sem_post(&ctx->free_jobs);
+}
+int enable_async_io(struct encrypt_ctx *ctx, int depth) {
+(void)ctx;
+(void)depth;
+return 0;
+}
+int input_async(struct encrypt_ctx *ctx) {
+(void)ctx;
+return 0;
+}
+int output_async(struct encrypt_ctx *ctx) {
+(void)ctx;
+return 0;
+}
+int read_input_submit(struct encrypt_ctx *ctx, char *buf, int len) {
+(void)ctx;
+(void)buf;
+(void)len;
+return 0;
+}
+int read_input_complete(struct encrypt_ctx *ctx) {
+(void)ctx;
+return 0;
+}
+int write_output_submit(struct encrypt_ctx *ctx, const struct iovec *blocks, int count) {
+(void)ctx;
+(void)blocks;
+(void)count;
+return 0;
+}
+int write_output_complete(struct encrypt_ctx *ctx) {
+(void)ctx;
+return 0;
+}
+int encrypt(struct encrypt_ctx *ctx, int c) {
+return (unsigned char)ctx->engine->encrypt((char)c, ctx->key, ctx->encrypt_offset++, get_nonce(ctx));
+}
+void encrypt_block(struct encrypt_ctx *ctx, const char *in, char *out, size_t len, int k, long long offset,
+const unsigned char *nonce) {
+ctx->engine->encrypt_block(in, out, len, k, offset, nonce);
+}
+void decrypt_block(struct encrypt_ctx *ctx, const char *in, char *out, size_t len, int k, long long offset,
+const unsigned char *nonce) {
+ctx->engine->decrypt_block(in, out, len, k, offset, nonce);
+}
+int get_key(struct encrypt_ctx *ctx) {
+return ctx->key;
+}
+const unsigned char *get_nonce(struct encrypt_ctx *ctx) {
+return ctx->nonces[(ctx->jobs_opened - 1) % JOB_SLOTS];
+}
+int get_epoch(struct encrypt_ctx *ctx) {
+return ctx->epoch;
+}
+long long get_offset(struct encrypt_ctx *ctx) {
+return ctx->block_offset;
+}
+int get_spans(struct encrypt_ctx *ctx, struct block_span *spans) {
+memcpy(spans, ctx->spans, sizeof(struct block_span) * ctx->span_count);
+return ctx->span_count;
+}
+int encrypt_count_block(struct encrypt_ctx *ctx, const char *in, char *out, size_t len, int k, long long offset,
+const unsigned char *nonce, int e) {
+struct count_shard *shard = epoch_shard(epoch_set(&ctx->epochs, e));
+if (!shard) {
+return 0;
+}
+ctx->engine->count_block(shard->input_lane_counts, in, len);
+ctx->engine->encrypt_block(in, out, len, k, offset, nonce);
+ctx->engine->count_block(shard->output_lane_counts, out, len);
+shard->input_total_count += len;
+shard->output_total_count += len;
+return 1;
+}
+void count_finished(struct encrypt_ctx *ctx, int e) {
+epoch_count_input(&ctx->epochs, e);
+epoch_count_output(&ctx->epochs, e);
+}
+void count_whole_epoch(struct encrypt_ctx *ctx, int e) {
+epoch_retire(&ctx->epochs, e);
+}
+int count_input(struct encrypt_ctx *ctx, int c) {
+char ch = c;
+return count_input_block(ctx, &ch, 1, ctx->epoch);
+}
+int count_output(struct encrypt_ctx *ctx, int c) {
+char ch = c;
+return count_output_block(ctx, &ch, 1, ctx->epoch);
+}
+// an epoch is at most RESET_INTERVAL characters, far from overflowing the lanes
+int count_input_block(struct encrypt_ctx *ctx, const char *buf, size_t len, int e) {
+struct count_shard *shard = epoch_shard(epoch_count_input(&ctx->epochs, e));
+if (!shard) {
+return 0;
+}
+ctx->engine->count_block(shard->input_lane_counts, buf, len);
+shard->input_total_count += len;
+return 1;
+}
+int count_output_block(struct encrypt_ctx *ctx, const char *buf, size_t len, int e) {
+struct count_shard *shard = epoch_shard(epoch_count_output(&ctx->epochs, e));
+if (!shard) {
+return 0;
+}
+ctx->engine->count_block(shard->output_lane_counts, buf, len);
+shard->output_total_count += len;
+return 1;
+}
+long long get_input_count(struct encrypt_ctx *ctx, int c) {
+return epoch_input_count(epoch_input_set(&ctx->epochs), (unsigned char)c);
+}
+long long get_output_count(struct encrypt_ctx *ctx, int c) {
+return epoch_output_count(epoch_output_set(&ctx->epochs), (unsigned char)c);
+}
+long long get_input_total_count(struct encrypt_ctx *ctx) {
+return epoch_input_total(epoch_input_set(&ctx->epochs));
+}
+long long get_output_total_count(struct encrypt_ctx *ctx) {
+return epoch_output_total(epoch_output_set(&ctx->epochs));
+}
+void log_counts(struct encrypt_ctx *ctx) {
+epoch_finish(&ctx->epochs);
+}
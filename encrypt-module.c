@@ -1,8 +1,8 @@
+#define _GNU_SOURCE // O_DIRECT
 #include "encrypt-module.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <time.h>
 #define encrypt encrypt_unistd
 #include <unistd.h>
@@ -11,102 +11,1134 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "encrypt-uring.h"
+#include "encrypt-arena.h"
+#include "encrypt-epoch.h"
+#include "encrypt-binlog.h"
+#include "encrypt-index.h"
+#include "encrypt-engine.h"
+
+// with direct output, writes are staged here and only whole aligned chunks go out
+#define DIRECT_ALIGNMENT 4096
+#define DIRECT_STAGING_SIZE (1 << 20)
+
+// io_uring backend, one ring per direction so the reader and the writer never share one.
+// Requests are kept in submission order, completions are matched to them by sequence number.
+struct async_request {
+    char *buf;            // read target
+    int len;              // characters read or written when complete
+    int result;           // completion result
+    int done;
+    struct iovec *blocks; // write sources, copied since they must outlive the call
+    int count;
+    int capacity;
+    off_t offset;
+};
+
+// number of characters read between two resets
+#define RESET_INTERVAL 200
+
+// most spans a block may have, the reader must stay fewer than EPOCH_KEYS epochs ahead
+// of the oldest one it has not handed on yet
+#define MAX_BLOCK_SPANS (EPOCH_KEYS / 2)
+
+// The epoch a read position is in. The reader and the io_uring reads queued ahead of it
+// each keep one, so that both cut the input into the same blocks.
+struct reset_cursor {
+    long long start;  // input offset the epoch starts at
+    long long reset;  // and the reset point that ends it
+    long long record; // decrypting, the record of the key index the epoch has
+};
+
+// Jobs opened by init(), one after another. The reader moves to a job as soon as it is
+// opened, while the writer and the logger are still on earlier ones: each side keeps its
+// own position and the jobs in between wait here with their files open.
+#define JOB_SLOTS EPOCH_SETS
+struct job {
+    FILE *output;
+    FILE *log;
+    FILE *index;         // key index next to the log, NULL without one
+    int last_epoch;      // last epoch of the job's input, INT_MAX while it is read
+    atomic_int finished; // sides done with the job, the writer and the logger
+    // the stream ciphers encrypt the job's file under it, see engine_nonce()
+    unsigned char nonce[ENGINE_NONCE_SIZE];
+};
+
+// one log entry, two lines of 256 counts of at most 22 characters each plus the headers
+#define LOG_ENTRY_SIZE 12288
+
+// Everything one pipeline's module state consists of, nothing is shared between contexts.
+struct encrypt_ctx {
+    void *owner;
+    struct arena arena;
+    struct epochs epochs;
+
+    FILE *input_file;
+    FILE *output_file;
+    FILE *log_file;
+    // regular input files are mapped whole, input_offset is the next unread character
+    const char *input_map;
+    size_t input_map_size;
+    size_t input_offset;
+    char *direct_staging;
+    size_t direct_staged;
+
+    int uring_depth;
+    struct uring input_uring, output_uring;
+    int input_async_on, output_async_on;
+    struct async_request *input_requests, *output_requests;
+    unsigned long long input_submitted, input_completed;
+    unsigned long long output_submitted, output_completed;
+    off_t input_size, input_submit_offset;
+    off_t output_offset;
+
+    // cipher and counting applied to every block, see encrypt-engine.h
+    const struct cipher_engine *engine;
+    int key;
+    int epoch;
+    long long read_offset;    // characters read so far
+    long long block_offset;   // input offset of the block read last
+    long long encrypt_offset; // position of the next character encrypt() is given
+    // set by read_input_block() when a block ends on a reset point, the next read does the reset
+    int reset_pending;
+    long long input_end;      // input offset reading stops at, LLONG_MAX for the whole input
+    struct reset_cursor reader; // the epoch the next read is in
+    struct reset_cursor queued; // the same for the next io_uring read queued
+    // spans of the block read last, see get_spans()
+    struct block_span *spans;
+    int span_count;
+    int max_spans;
+
+    // Decrypting, resets fall where the records of the key index start instead of every
+    // RESET_INTERVAL characters.
+    int decrypting;
+    struct index_reader index;
+
+    struct job jobs[JOB_SLOTS];
+    int jobs_opened; // reader side
+    int output_job;  // writer side
+    int log_job;     // logger side
+    sem_t free_jobs; // slots the reader may open a job in
+
+    // threads that count into the epochs, each gets a shard of every set
+    int count_threads;
+    // entries go out in the binary format of encrypt-binlog.h when set
+    int binary_log;
+    // every job gets a key index, named after its log
+    int key_index;
+    const char *log_name;     // log of the job opened last
+    long long index_offset;   // logger side, input offset of the next epoch in its job
+    char log_entry[LOG_ENTRY_SIZE];
+    // why the last init() failed, see encrypt_ctx_error()
+    char error[PATH_MAX + 64];
+};
 
-FILE *input_file;
-FILE *output_file;
-FILE *log_file;
-int input_counts[256];
-int output_counts[256];
-int input_total_count;
-int output_total_count;
-int key = 1;
-int read_count = 0;
-sem_t *sem_char_read;
+// closes f unless it is one of the standard streams
+static void close_file(FILE *f) {
+    if (f && f != stdin && f != stdout && f != stderr) {
+        fclose(f);
+    }
+}
 
-void clear_counts() {
-    memset(input_counts, 0, sizeof(input_counts));
-    memset(output_counts, 0, sizeof(output_counts));
-    input_total_count = 0;
-    output_total_count = 0;
+struct encrypt_ctx *encrypt_ctx_new(void *owner) {
+    struct encrypt_ctx *ctx = calloc(1, sizeof(struct encrypt_ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->owner = owner;
+    arena_init(&ctx->arena);
+    ctx->engine = &shift_engine;
+    ctx->key = 1;
+    ctx->count_threads = 2;
+    ctx->max_spans = 1;
+    ctx->input_end = LLONG_MAX;
+    ctx->reader.reset = ctx->queued.reset = RESET_INTERVAL;
+    ctx->index.fd = -1;
+    return ctx;
 }
 
-void *random_reset() {
-    while (1) {
-        sem_wait(sem_char_read);
-        read_count++;
-        if (read_count == 200) {
-            reset_requested();
-            key += 5;
-            clear_counts();
-            reset_finished();
-            read_count = 0;
-        }
+void encrypt_ctx_free(struct encrypt_ctx *ctx) {
+    if (ctx->jobs_opened > 0) {
+        epoch_destroy(&ctx->epochs);
+        sem_destroy(&ctx->free_jobs);
+        // earlier jobs' logs are closed by the logger as it moves past them
+        close_file(ctx->jobs[ctx->log_job % JOB_SLOTS].log);
+        close_file(ctx->jobs[ctx->log_job % JOB_SLOTS].index);
+    }
+    index_close(&ctx->index);
+    if (ctx->input_map) {
+        munmap((void *)ctx->input_map, ctx->input_map_size);
+    }
+    close_file(ctx->input_file);
+    if (ctx->input_async_on) {
+        uring_destroy(&ctx->input_uring);
+    }
+    if (ctx->output_async_on) {
+        uring_destroy(&ctx->output_uring);
+    }
+    for (int i = 0; ctx->output_requests && i < ctx->uring_depth; i++) {
+        free(ctx->output_requests[i].blocks);
     }
+    free(ctx->input_requests);
+    free(ctx->output_requests);
+    free(ctx->direct_staging);
+    arena_destroy(&ctx->arena);
+    free(ctx);
 }
 
-void init(char *inputFileName, char *outputFileName, char *logFileName) {
-    pthread_t pid;
-    sem_char_read = sem_open("/sem_test_reset", O_CREAT, 0644, 0);
-    sem_unlink("/sem_test_reset");
-    pthread_create(&pid, NULL, &random_reset, NULL);
-    input_file = fopen(inputFileName, "r");
-    output_file = fopen(outputFileName, "w");
-    log_file = fopen(logFileName, "w");
+void *encrypt_ctx_owner(struct encrypt_ctx *ctx) {
+    return ctx->owner;
 }
 
-int read_input() {
-    sem_post(sem_char_read);
-    return fgetc(input_file);
+struct arena *encrypt_ctx_arena(struct encrypt_ctx *ctx) {
+    return &ctx->arena;
 }
 
-void write_output(int c) {
-    fputc(c, output_file);
+const char *encrypt_ctx_error(struct encrypt_ctx *ctx) {
+    return ctx->error;
 }
 
-int encrypt(int c) {
-    return (c + key - 32) % 94 + 32;
+// writes all of len, retrying short writes
+static void write_fully(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        buf += w;
+        len -= w;
+    }
 }
 
-void log_counts() {
-    fprintf(log_file, "Counts using key %d:\n", key);
-    fprintf(log_file, "Total input count: %d\n", input_total_count);
-    fprintf(log_file, "Plaintext frequency counts: [ %d", input_counts[0]);
-    for (int i = 1; i < 256; i++) {
-        fprintf(log_file, ", %d", input_counts[i]);
+// appends s at p and returns the new end
+static char *append_string(char *p, const char *s) {
+    while (*s) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+// appends v in decimal at p and returns the new end
+static char *append_int(char *p, long long v) {
+    char digits[20];
+    int n = 0;
+    unsigned long long u = v;
+    if (v < 0) {
+        *p++ = '-';
+        u = -u;
+    }
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    while (n > 0) {
+        *p++ = digits[--n];
     }
-    fprintf(log_file, "]\n");
-    fprintf(log_file, "Total output count: %d\n", output_total_count);
-    fprintf(log_file, "Ciphertext frequency counts: [ %d", output_counts[0]);
+    return p;
+}
+
+static char *append_counts(char *p, const char *title, const long long counts[256]) {
+    p = append_string(p, title);
+    p = append_string(p, ": [ ");
+    p = append_int(p, counts[0]);
     for (int i = 1; i < 256; i++) {
-        fprintf(log_file, ", %d", output_counts[i]);
+        p = append_string(p, ", ");
+        p = append_int(p, counts[i]);
+    }
+    return append_string(p, "]\n");
+}
+
+// a side is done with a job, the slot is free once both are
+static void finish_job(struct encrypt_ctx *ctx, struct job *job) {
+    if (atomic_fetch_add(&job->finished, 1) == 1) {
+        sem_post(&ctx->free_jobs);
+    }
+}
+
+// the magic tells the decoder which way the counts go
+static const char *binlog_magic(struct encrypt_ctx *ctx) {
+    return ctx->decrypting ? BINLOG_MAGIC_DECRYPT : BINLOG_MAGIC;
+}
+
+// Logs the counts of one finished epoch, called by the epoch logger thread. The entry
+// is formatted into log_entry and goes out with a single write.
+static void log_set(void *owner, struct count_set *set) {
+    struct encrypt_ctx *ctx = owner;
+    // epochs past the last one of a job belong to the jobs after it
+    while (set->epoch > ctx->jobs[ctx->log_job % JOB_SLOTS].last_epoch) {
+        struct job *done = &ctx->jobs[ctx->log_job % JOB_SLOTS];
+        close_file(done->log);
+        close_file(done->index);
+        done->log = done->index = NULL;
+        finish_job(ctx, done);
+        ctx->log_job++;
+        ctx->log_file = ctx->jobs[ctx->log_job % JOB_SLOTS].log;
+        ctx->index_offset = 0;
+    }
+    // epochs without characters hold no offset, records stay in increasing order
+    struct job *job = &ctx->jobs[ctx->log_job % JOB_SLOTS];
+    if (job->index && set->input_total_count > 0) {
+        struct index_entry entry = { ctx->index_offset, set->key };
+        char record[INDEX_RECORD_SIZE];
+        index_encode(record, &entry);
+        fwrite(record, 1, INDEX_RECORD_SIZE, job->index);
+    }
+    ctx->index_offset += set->input_total_count;
+    if (ctx->binary_log) {
+        struct binlog_entry e;
+        e.key = set->key;
+        e.input_total_count = set->input_total_count;
+        e.output_total_count = set->output_total_count;
+        memcpy(e.input_counts, set->input_counts, sizeof(e.input_counts));
+        memcpy(e.output_counts, set->output_counts, sizeof(e.output_counts));
+        write_fully(fileno(ctx->log_file), ctx->log_entry, binlog_encode(ctx->log_entry, &e));
+        return;
+    }
+    char *p = ctx->log_entry;
+    p = append_string(p, "Counts using key ");
+    p = append_int(p, set->key);
+    p = append_string(p, ":\nTotal input count: ");
+    p = append_int(p, set->input_total_count);
+    p = append_string(p, "\n");
+    // a decrypting run reads ciphertext and writes plaintext
+    p = append_counts(p, ctx->decrypting ? "Ciphertext frequency counts" : "Plaintext frequency counts", set->input_counts);
+    p = append_string(p, "Total output count: ");
+    p = append_int(p, set->output_total_count);
+    p = append_string(p, "\n");
+    p = append_counts(p, ctx->decrypting ? "Plaintext frequency counts" : "Ciphertext frequency counts", set->output_counts);
+    p = append_string(p, "\n");
+    write_fully(fileno(ctx->log_file), ctx->log_entry, p - ctx->log_entry);
+}
+
+// "-" stands for the standard stream
+static FILE *open_file(const char *name, const char *mode, FILE *standard) {
+    return strcmp(name, "-") == 0 ? standard : fopen(name, mode);
+}
+
+// the reader is done with the current job's input, the next job starts from scratch
+static void close_input(struct encrypt_ctx *ctx) {
+    if (ctx->input_map) {
+        munmap((void *)ctx->input_map, ctx->input_map_size);
+    }
+    ctx->input_map = NULL;
+    ctx->input_map_size = ctx->input_offset = 0;
+    close_file(ctx->input_file);
+    ctx->input_file = NULL;
+    ctx->jobs[(ctx->jobs_opened - 1) % JOB_SLOTS].last_epoch = ctx->epoch;
+    ctx->read_offset = ctx->block_offset = ctx->encrypt_offset = 0;
+    ctx->reader = ctx->queued = (struct reset_cursor){0, RESET_INTERVAL, 0};
+    ctx->input_end = LLONG_MAX;
+    // a reset the last block ended on is overtaken by the new job's key
+    ctx->reset_pending = 0;
+}
+
+// Undoes what init() opened of a job it cannot go on with, with the reason in error. The
+// job's slot goes back, so the next init() may try another job in it.
+static int abandon_job(struct encrypt_ctx *ctx, struct job *job, FILE *input, FILE *output, FILE *log) {
+    close_file(input);
+    close_file(output);
+    close_file(log);
+    job->output = job->log = job->index = NULL;
+    if (ctx->jobs_opened > 0) {
+        sem_post(&ctx->free_jobs);
+    }
+    return 0;
+}
+
+// opens the key index next to the log of job, "-" has none
+static int open_index(struct encrypt_ctx *ctx, struct job *job) {
+    char name[PATH_MAX];
+    if (!job->log || strcmp(ctx->log_name, "-") == 0 ||
+        snprintf(name, sizeof(name), "%s.idx", ctx->log_name) >= (int)sizeof(name)) {
+        return 0;
+    }
+    job->index = fopen(name, "w");
+    if (!job->index) {
+        return 0;
+    }
+    fwrite(INDEX_MAGIC, 1, INDEX_MAGIC_SIZE, job->index);
+    fwrite(job->nonce, 1, ENGINE_NONCE_SIZE, job->index);
+    return 1;
+}
+
+int init(struct encrypt_ctx *ctx, char *inputFileName, char *outputFileName, char *logFileName) {
+    if (ctx->jobs_opened > 0) {
+        // a job that failed to open has already closed the input
+        if (ctx->input_file) {
+            close_input(ctx);
+        }
+        // the job JOB_SLOTS back has to be written and logged before its slot is reused
+        while (sem_wait(&ctx->free_jobs) != 0 && errno == EINTR) {
+        }
+    }
+    struct job *job = &ctx->jobs[ctx->jobs_opened % JOB_SLOTS];
+    FILE *input = open_file(inputFileName, "r", stdin);
+    FILE *output = input ? open_file(outputFileName, "w", stdout) : NULL;
+    FILE *log = output ? open_file(logFileName, "w", stderr) : NULL;
+    if (!log) {
+        snprintf(ctx->error, sizeof(ctx->error), "%s: %s",
+                 !input ? inputFileName : !output ? outputFileName : logFileName, strerror(errno));
+        return abandon_job(ctx, job, input, output, log);
+    }
+    // a decrypting job takes the nonce of its index instead
+    if (!engine_nonce(job->nonce)) {
+        snprintf(ctx->error, sizeof(ctx->error), "No random nonce for %s", inputFileName);
+        return abandon_job(ctx, job, input, output, log);
+    }
+    job->output = output;
+    job->log = log;
+    job->index = NULL;
+    ctx->log_name = logFileName;
+    if (ctx->jobs_opened == 0) {
+        // shards are most of the memory, only the threads that will count get one
+        struct count_set *sets = arena_alloc(&ctx->arena, sizeof(struct count_set) * EPOCH_SETS, -1);
+        struct count_shard *shards = arena_alloc(&ctx->arena, sizeof(struct count_shard) * EPOCH_SETS * ctx->count_threads, -1);
+        ctx->spans = arena_alloc(&ctx->arena, sizeof(struct block_span) * ctx->max_spans, -1);
+        if (!sets || !shards || !ctx->spans) {
+            snprintf(ctx->error, sizeof(ctx->error), "Memory allocation failed");
+            return abandon_job(ctx, job, input, output, log);
+        }
+        ctx->output_file = job->output;
+        ctx->log_file = job->log;
+        sem_init(&ctx->free_jobs, 0, JOB_SLOTS - 1);
+        ctx->engine->init();
+        ctx->key = ctx->engine->initial_key;
+        epoch_init(&ctx->epochs, sets, shards, ctx->count_threads, ctx->key, log_set, ctx);
+    } else {
+        if (ctx->key_index && !open_index(ctx, job) && needs_key_index(ctx)) {
+            snprintf(ctx->error, sizeof(ctx->error), "No key index for %s, the output could never be decrypted", logFileName);
+            return abandon_job(ctx, job, input, output, log);
+        }
+        // every job counts and logs from an epoch of its own
+        ctx->key = ctx->engine->initial_key;
+        ctx->epoch = epoch_begin(&ctx->epochs, ctx->key);
+        if (ctx->binary_log) {
+            write_fully(fileno(job->log), binlog_magic(ctx), BINLOG_MAGIC_SIZE);
+        }
+    }
+    ctx->input_file = input;
+    job->last_epoch = INT_MAX;
+    atomic_store(&job->finished, 0);
+    ctx->jobs_opened++;
+
+    // map regular files so blocks can be handed out in place, pipes and terminals are streamed
+    struct stat st;
+    if (ctx->input_file && fstat(fileno(ctx->input_file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(ctx->input_file), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            ctx->input_map = map;
+            ctx->input_map_size = st.st_size;
+        }
+    }
+    return 1;
+}
+
+// Moves c to a record of the key index and returns its key, the current key where the
+// index has no such record.
+static int load_record(struct encrypt_ctx *ctx, struct reset_cursor *c, long long record) {
+    struct index_entry entry, next;
+    int key = ctx->key;
+    if (index_get(&ctx->index, record, &entry)) {
+        key = entry.key;
+        c->start = entry.offset;
+    }
+    c->record = record;
+    c->reset = index_get(&ctx->index, record + 1, &next) ? next.offset : LLONG_MAX;
+    return key;
+}
+
+// Moves c on to the epoch its reset point starts. Decrypting, that is the next record
+// and its key is returned, otherwise the current key for the caller to reset.
+static int pass_reset(struct encrypt_ctx *ctx, struct reset_cursor *c) {
+    if (ctx->decrypting) {
+        return load_record(ctx, c, c->record + 1);
+    }
+    c->start = c->reset;
+    c->reset += RESET_INTERVAL;
+    return ctx->key;
+}
+
+// How much of len a block at offset may take. Inside an epoch it stops at the reset point.
+// From the start of one it may go on over further resets, up to max_spans epochs, and is
+// then cut back to the last reset point it reaches so that it leaves no epoch unfinished.
+static long long block_limit(struct encrypt_ctx *ctx, const struct reset_cursor *c, long long offset, long long len) {
+    if (offset != c->start || len <= c->reset - offset) {
+        return len < c->reset - offset ? len : c->reset - offset;
+    }
+    long long end = len > LLONG_MAX - offset ? LLONG_MAX : offset + len;
+    if (ctx->decrypting) {
+        struct index_entry entry;
+        if (index_get(&ctx->index, c->record + ctx->max_spans, &entry) && end > entry.offset) {
+            end = entry.offset;
+        }
+        if (index_get(&ctx->index, index_find(&ctx->index, end), &entry)) {
+            end = entry.offset;
+        }
+    } else {
+        long long last = c->reset + (long long)(ctx->max_spans - 1) * RESET_INTERVAL;
+        if (end > last) {
+            end = last;
+        }
+        end -= (end - c->start) % RESET_INTERVAL;
+    }
+    return end - offset;
+}
+
+// Does a reset the previous read ended on. It only happens once the caller has handed
+// the previous block on and comes back for more, or inside a block that goes on past it,
+// and it starts the next key epoch without waiting for blocks of the old one still in
+// flight. Decrypting, the next key comes from the index instead.
+static void wait_for_reset(struct encrypt_ctx *ctx) {
+    if (ctx->reset_pending) {
+        reset_requested(ctx);
+        int key = pass_reset(ctx, &ctx->reader);
+        ctx->key = ctx->decrypting ? key : ctx->engine->on_reset(ctx->key);
+        ctx->epoch = epoch_begin(&ctx->epochs, ctx->key);
+        reset_finished(ctx);
+        ctx->reset_pending = 0;
     }
-    fprintf(log_file, "]\n\n");
 }
 
-void count_input(int c) {
-    input_counts[c]++;
-    input_total_count++;
+// Accounts for got characters read as the spans of a block, doing the resets between
+// them. A reset the block ends on is left pending for the next read.
+static void end_block(struct encrypt_ctx *ctx, int got) {
+    int ended = got == 0;
+    ctx->block_offset = ctx->read_offset;
+    ctx->span_count = 0;
+    for (;;) {
+        long long room = ctx->reader.reset - ctx->read_offset;
+        int length = got < room ? got : room;
+        struct block_span *span = &ctx->spans[ctx->span_count++];
+        span->length = length;
+        span->key = ctx->key;
+        span->epoch = ctx->epoch;
+        span->whole = ctx->read_offset == ctx->reader.start && length == room;
+        span->last = length == room || ended;
+        ctx->read_offset += length;
+        got -= length;
+        ctx->reset_pending = length > 0 && length == room;
+        if (got == 0) {
+            break;
+        }
+        wait_for_reset(ctx);
+    }
 }
 
-void count_output(int c) {
-    output_counts[c]++;
-    output_total_count++;
+int read_input(struct encrypt_ctx *ctx) {
+    wait_for_reset(ctx);
+    int c = EOF;
+    if (ctx->read_offset >= ctx->input_end) {
+        // the end of a range sought to
+    } else if (ctx->input_map) {
+        if (ctx->input_offset < ctx->input_map_size) {
+            c = (unsigned char)ctx->input_map[ctx->input_offset++];
+        }
+    } else {
+        c = fgetc(ctx->input_file);
+    }
+    // the end of input is not a character, it takes no room before the next reset
+    end_block(ctx, c != EOF);
+    return c;
 }
 
-int get_input_count(int c) {
-    return input_counts[c];
+int input_mapped(struct encrypt_ctx *ctx) {
+    return ctx->input_map != NULL;
 }
 
-int get_output_count(int c) {
-    return output_counts[c];
+// waits for a pending reset and returns how much of len the next block may take
+static int begin_block(struct encrypt_ctx *ctx, int len) {
+    wait_for_reset(ctx);
+    long long room = block_limit(ctx, &ctx->reader, ctx->read_offset, len);
+    if (room > ctx->input_end - ctx->read_offset) {
+        room = ctx->input_end - ctx->read_offset;
+    }
+    if (len > room) {
+        len = room;
+    }
+    return len;
 }
 
-int get_input_total_count() {
-    return input_total_count;
+int read_input_view(struct encrypt_ctx *ctx, const char **block, int len) {
+    len = begin_block(ctx, len);
+    if ((size_t)len > ctx->input_map_size - ctx->input_offset) {
+        len = ctx->input_map_size - ctx->input_offset;
+    }
+    *block = ctx->input_map + ctx->input_offset;
+    ctx->input_offset += len;
+    end_block(ctx, len);
+    return len;
 }
 
-int get_output_total_count() {
-    return output_total_count;
+int read_input_block(struct encrypt_ctx *ctx, char *buf, int len) {
+    len = begin_block(ctx, len);
+    int got = 0;
+    if (ctx->input_map) {
+        if ((size_t)len > ctx->input_map_size - ctx->input_offset) {
+            len = ctx->input_map_size - ctx->input_offset;
+        }
+        memcpy(buf, ctx->input_map + ctx->input_offset, len);
+        ctx->input_offset += len;
+        got = len;
+    } else {
+        // pipes and sockets return whatever is available, that much is passed on right away
+        while (got == 0) {
+            ssize_t r = read(fileno(ctx->input_file), buf, len);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            got = r;
+        }
+    }
+    end_block(ctx, got);
+    return got;
 }
 
+void write_output(struct encrypt_ctx *ctx, int c) {
+    fputc(c, ctx->output_file);
+}
+
+int enable_binary_log(struct encrypt_ctx *ctx) {
+    if (!ctx->log_file) {
+        return 0;
+    }
+    write_fully(fileno(ctx->log_file), binlog_magic(ctx), BINLOG_MAGIC_SIZE);
+    ctx->binary_log = 1;
+    return 1;
+}
+
+int enable_key_index(struct encrypt_ctx *ctx) {
+    if (!open_index(ctx, &ctx->jobs[(ctx->jobs_opened - 1) % JOB_SLOTS])) {
+        return 0;
+    }
+    ctx->key_index = 1;
+    return 1;
+}
+
+// makes record the one the next read is in, its key the key of the current epoch
+static void start_record(struct encrypt_ctx *ctx, long long record) {
+    ctx->key = load_record(ctx, &ctx->reader, record);
+    epoch_rekey(&ctx->epochs, ctx->key);
+    ctx->queued = ctx->reader;
+    ctx->reset_pending = 0;
+}
+
+int enable_decrypt(struct encrypt_ctx *ctx, const char *index_name) {
+    if (!index_open(&ctx->index, index_name)) {
+        return 0;
+    }
+    ctx->decrypting = 1;
+    memcpy(ctx->jobs[(ctx->jobs_opened - 1) % JOB_SLOTS].nonce, ctx->index.nonce, ENGINE_NONCE_SIZE);
+    start_record(ctx, 0);
+    return 1;
+}
+
+int seek_input(struct encrypt_ctx *ctx, long long offset, long long length) {
+    struct stat st;
+    if (!ctx->decrypting || ctx->input_async_on || offset < 0 || length < 0 || !ctx->input_file ||
+        fstat(fileno(ctx->input_file), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    if (!ctx->input_map && fseeko(ctx->input_file, offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    // past the end the first read finds nothing left
+    ctx->input_offset = ctx->input_map && (size_t)offset > ctx->input_map_size ? ctx->input_map_size : (size_t)offset;
+    ctx->read_offset = ctx->block_offset = ctx->encrypt_offset = offset;
+    ctx->input_end = length > LLONG_MAX - offset ? LLONG_MAX : offset + length;
+    start_record(ctx, index_find(&ctx->index, offset));
+    return 1;
+}
+
+int enable_direct_output(struct encrypt_ctx *ctx) {
+    fflush(ctx->output_file);
+    int fd = fileno(ctx->output_file);
+    int flags = fcntl(fd, F_GETFL);
+    // the file offset has to stay aligned too, so only start on an empty file
+    if (flags < 0 || lseek(fd, 0, SEEK_CUR) % DIRECT_ALIGNMENT != 0 ||
+        fcntl(fd, F_SETFL, flags | O_DIRECT) != 0) {
+        return 0;
+    }
+    if (posix_memalign((void **)&ctx->direct_staging, DIRECT_ALIGNMENT, DIRECT_STAGING_SIZE) != 0) {
+        fcntl(fd, F_SETFL, flags);
+        ctx->direct_staging = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+void write_output_blocks(struct encrypt_ctx *ctx, const struct iovec *blocks, int count) {
+    int fd = fileno(ctx->output_file);
+    if (!ctx->direct_staging) {
+        // anything write_output() buffered goes first
+        fflush(ctx->output_file);
+        while (count > 0) {
+            int batch = count < IOV_MAX ? count : IOV_MAX;
+            size_t total = 0;
+            for (int i = 0; i < batch; i++) {
+                total += blocks[i].iov_len;
+            }
+            ssize_t w = writev(fd, blocks, batch);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return;
+            if ((size_t)w < total) {
+                // finish a short write block by block
+                for (int i = 0; i < batch; i++) {
+                    if ((size_t)w >= blocks[i].iov_len) {
+                        w -= blocks[i].iov_len;
+                    } else {
+                        write_fully(fd, (const char *)blocks[i].iov_base + w, blocks[i].iov_len - w);
+                        w = 0;
+                    }
+                }
+            }
+            blocks += batch;
+            count -= batch;
+        }
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const char *buf = blocks[i].iov_base;
+        size_t len = blocks[i].iov_len;
+        while (len > 0) {
+            size_t room = DIRECT_STAGING_SIZE - ctx->direct_staged;
+            size_t take = len < room ? len : room;
+            memcpy(ctx->direct_staging + ctx->direct_staged, buf, take);
+            ctx->direct_staged += take;
+            buf += take;
+            len -= take;
+            if (ctx->direct_staged == DIRECT_STAGING_SIZE) {
+                write_fully(fd, ctx->direct_staging, ctx->direct_staged);
+                ctx->direct_staged = 0;
+            }
+        }
+    }
+}
+
+void write_output_block(struct encrypt_ctx *ctx, const char *buf, size_t len) {
+    struct iovec block = { (void *)buf, len };
+    write_output_blocks(ctx, &block, 1);
+}
+
+int enable_async_io(struct encrypt_ctx *ctx, int depth) {
+    struct stat st;
+    ctx->uring_depth = depth;
+    ctx->input_requests = calloc(depth, sizeof(struct async_request));
+    ctx->output_requests = calloc(depth, sizeof(struct async_request));
+    if (!ctx->input_requests || !ctx->output_requests) {
+        return 0;
+    }
+
+    // reads go to absolute offsets, so only regular files qualify; they replace the mapping
+    if (fstat(fileno(ctx->input_file), &st) == 0 && S_ISREG(st.st_mode) && uring_init(&ctx->input_uring, depth) == 0) {
+        ctx->input_async_on = 1;
+        ctx->input_size = st.st_size < ctx->input_end ? st.st_size : ctx->input_end;
+        ctx->input_submit_offset = ctx->input_offset;
+        if (ctx->input_map) {
+            munmap((void *)ctx->input_map, ctx->input_map_size);
+            ctx->input_map = NULL;
+        }
+    }
+    // direct output keeps its own staging buffer and stays synchronous
+    if (!ctx->direct_staging && fstat(fileno(ctx->output_file), &st) == 0 && S_ISREG(st.st_mode) &&
+        uring_init(&ctx->output_uring, depth) == 0) {
+        ctx->output_async_on = 1;
+        fflush(ctx->output_file);
+        ctx->output_offset = lseek(fileno(ctx->output_file), 0, SEEK_CUR);
+    }
+    return ctx->input_async_on || ctx->output_async_on;
+}
+
+int input_async(struct encrypt_ctx *ctx) {
+    return ctx->input_async_on;
+}
+
+int output_async(struct encrypt_ctx *ctx) {
+    return ctx->output_async_on;
+}
+
+// a ring that failed is of no further use, the caller hands the error on
+static int uring_failed(struct encrypt_ctx *ctx, const char *call) {
+    snprintf(ctx->error, sizeof(ctx->error), "io_uring %s failed: %s", call, strerror(errno));
+    return 0;
+}
+
+// waits for one completion on u and marks the matching request done, 0 if the wait failed
+static int reap(struct encrypt_ctx *ctx, struct uring *u, struct async_request *requests) {
+    struct io_uring_cqe cqe;
+    if (uring_wait(u, &cqe) < 0) {
+        return uring_failed(ctx, "wait");
+    }
+    struct async_request *r = &requests[cqe.user_data % ctx->uring_depth];
+    r->result = cqe.res;
+    r->done = 1;
+    return 1;
+}
+
+// submits what u has prepared, reaping completions while the kernel has no room for it
+static int submit(struct encrypt_ctx *ctx, struct uring *u, struct async_request *requests) {
+    int submitted;
+    while ((submitted = uring_submit(u)) == 0) {
+        if (!reap(ctx, u, requests)) {
+            return 0;
+        }
+    }
+    if (submitted < 0) {
+        return uring_failed(ctx, "submit");
+    }
+    return 1;
+}
+
+int read_input_submit(struct encrypt_ctx *ctx, char *buf, int len) {
+    // the same block lengths read_input_block() would produce, past the resets it would do
+    while (ctx->input_submit_offset >= ctx->queued.reset) {
+        pass_reset(ctx, &ctx->queued);
+    }
+    len = block_limit(ctx, &ctx->queued, ctx->input_submit_offset, len);
+    if (len > ctx->input_size - ctx->input_submit_offset) {
+        len = ctx->input_size - ctx->input_submit_offset;
+    }
+
+    struct async_request *r = &ctx->input_requests[ctx->input_submitted % ctx->uring_depth];
+    r->buf = buf;
+    r->len = len;
+    r->offset = ctx->input_submit_offset;
+    r->result = 0;
+    r->done = len == 0;
+    if (len > 0) {
+        struct io_uring_sqe *sqe = uring_prepare(&ctx->input_uring);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fileno(ctx->input_file);
+        sqe->addr = (unsigned long)buf;
+        sqe->len = len;
+        sqe->off = ctx->input_submit_offset;
+        sqe->user_data = ctx->input_submitted;
+        if (!submit(ctx, &ctx->input_uring, ctx->input_requests)) {
+            return -1;
+        }
+    }
+    ctx->input_submitted++;
+    ctx->input_submit_offset += len;
+    return len;
+}
+
+int read_input_complete(struct encrypt_ctx *ctx) {
+    struct async_request *r = &ctx->input_requests[ctx->input_completed % ctx->uring_depth];
+    while (!r->done) {
+        if (!reap(ctx, &ctx->input_uring, ctx->input_requests)) {
+            return -1;
+        }
+    }
+    ctx->input_completed++;
+
+    // finish a short read synchronously so block lengths stay as submitted
+    int got = r->result > 0 ? r->result : 0;
+    while (got < r->len) {
+        ssize_t more = pread(fileno(ctx->input_file), r->buf + got, r->len - got, r->offset + got);
+        if (more < 0 && errno == EINTR) continue;
+        if (more <= 0) break;
+        got += more;
+    }
+
+    wait_for_reset(ctx);
+    end_block(ctx, got);
+    return got;
+}
+
+int write_output_submit(struct encrypt_ctx *ctx, const struct iovec *blocks, int count) {
+    struct async_request *r = &ctx->output_requests[ctx->output_submitted % ctx->uring_depth];
+    if (count > r->capacity) {
+        r->blocks = realloc(r->blocks, sizeof(struct iovec) * count);
+        r->capacity = count;
+    }
+    memcpy(r->blocks, blocks, sizeof(struct iovec) * count);
+    r->count = count;
+    r->len = 0;
+    for (int i = 0; i < count; i++) {
+        r->len += blocks[i].iov_len;
+    }
+    r->offset = ctx->output_offset;
+    r->result = 0;
+    r->done = r->len == 0;
+    if (r->len > 0) {
+        struct io_uring_sqe *sqe = uring_prepare(&ctx->output_uring);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fileno(ctx->output_file);
+        sqe->addr = (unsigned long)r->blocks;
+        sqe->len = count;
+        sqe->off = ctx->output_offset;
+        sqe->user_data = ctx->output_submitted;
+        if (!submit(ctx, &ctx->output_uring, ctx->output_requests)) {
+            return 0;
+        }
+    }
+    ctx->output_submitted++;
+    ctx->output_offset += r->len;
+    return 1;
+}
+
+int write_output_complete(struct encrypt_ctx *ctx) {
+    struct async_request *r = &ctx->output_requests[ctx->output_completed % ctx->uring_depth];
+    while (!r->done) {
+        if (!reap(ctx, &ctx->output_uring, ctx->output_requests)) {
+            return 0;
+        }
+    }
+    ctx->output_completed++;
+
+    // finish a short or failed write synchronously
+    if (r->result < r->len) {
+        int written = r->result > 0 ? r->result : 0;
+        off_t offset = r->offset;
+        for (int i = 0; i < r->count; i++) {
+            const char *buf = r->blocks[i].iov_base;
+            size_t len = r->blocks[i].iov_len;
+            size_t skip = (size_t)written < len ? (size_t)written : len;
+            written -= skip;
+            offset += skip;
+            buf += skip;
+            len -= skip;
+            while (len > 0) {
+                ssize_t w = pwrite(fileno(ctx->output_file), buf, len, offset);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) return 1;
+                buf += w;
+                len -= w;
+                offset += w;
+            }
+        }
+    }
+    return 1;
+}
+
+void finish_output(struct encrypt_ctx *ctx) {
+    flush_output(ctx);
+    struct job *done = &ctx->jobs[ctx->output_job % JOB_SLOTS];
+    close_file(done->output);
+    done->output = NULL;
+    finish_job(ctx, done);
+    ctx->output_job++;
+    ctx->output_file = ctx->jobs[ctx->output_job % JOB_SLOTS].output;
+}
+
+int flush_output(struct encrypt_ctx *ctx) {
+    while (ctx->output_async_on && ctx->output_completed < ctx->output_submitted) {
+        if (!write_output_complete(ctx)) {
+            return 0;
+        }
+    }
+    fflush(ctx->output_file);
+    if (ctx->direct_staging && ctx->direct_staged > 0) {
+        int fd = fileno(ctx->output_file);
+        // the aligned part goes out directly, the unaligned tail without O_DIRECT
+        size_t aligned = ctx->direct_staged - ctx->direct_staged % DIRECT_ALIGNMENT;
+        write_fully(fd, ctx->direct_staging, aligned);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        write_fully(fd, ctx->direct_staging + aligned, ctx->direct_staged - aligned);
+        ctx->direct_staged = 0;
+    }
+    return 1;
+}
+
+int needs_key_index(struct encrypt_ctx *ctx) {
+    return ctx->engine->uses_nonce && !ctx->decrypting;
+}
+
+int block_spans(struct encrypt_ctx *ctx, int len) {
+    (void)ctx;
+    int spans = len / RESET_INTERVAL + 1;
+    return spans < MAX_BLOCK_SPANS ? spans : MAX_BLOCK_SPANS;
+}
+
+int block_reach(int len) {
+    if (len <= RESET_INTERVAL) {
+        return len;
+    }
+    int spans = len / RESET_INTERVAL;
+    return (spans < MAX_BLOCK_SPANS ? spans : MAX_BLOCK_SPANS) * RESET_INTERVAL;
+}
+
+int set_block_spans(struct encrypt_ctx *ctx, int spans) {
+    if (spans < 1 || spans > MAX_BLOCK_SPANS || ctx->jobs_opened > 0) {
+        return 0;
+    }
+    ctx->max_spans = spans;
+    return 1;
+}
+
+int set_count_threads(struct encrypt_ctx *ctx, int threads) {
+    if (threads < 1 || threads > EPOCH_SHARDS || ctx->jobs_opened > 0) {
+        return 0;
+    }
+    ctx->count_threads = threads;
+    return 1;
+}
+
+int select_engine(struct encrypt_ctx *ctx, const char *name) {
+    const struct cipher_engine *e = engine_find(name);
+    if (!e || !e->init()) {
+        return 0;
+    }
+    ctx->engine = e;
+    return 1;
+}
+
+// the engines see characters the way the block kernels read them, as char, and the
+// result is handed back as unsigned char so that no character can look like EOF
+int encrypt(struct encrypt_ctx *ctx, int c) {
+    if (ctx->decrypting) {
+        char in = c, out;
+        ctx->engine->decrypt_block(&in, &out, 1, ctx->key, ctx->encrypt_offset++, get_nonce(ctx));
+        return (unsigned char)out;
+    }
+    return (unsigned char)ctx->engine->encrypt((char)c, ctx->key, ctx->encrypt_offset++, get_nonce(ctx));
+}
+
+void encrypt_block(struct encrypt_ctx *ctx, const char *in, char *out, size_t len, int k, long long offset,
+                   const unsigned char *nonce) {
+    if (ctx->decrypting) {
+        ctx->engine->decrypt_block(in, out, len, k, offset, nonce);
+    } else {
+        ctx->engine->encrypt_block(in, out, len, k, offset, nonce);
+    }
+}
+
+void decrypt_block(struct encrypt_ctx *ctx, const char *in, char *out, size_t len, int k, long long offset,
+                   const unsigned char *nonce) {
+    ctx->engine->decrypt_block(in, out, len, k, offset, nonce);
+}
+
+int get_key(struct encrypt_ctx *ctx) {
+    return ctx->key;
+}
+
+const unsigned char *get_nonce(struct encrypt_ctx *ctx) {
+    return ctx->jobs[(ctx->jobs_opened - 1) % JOB_SLOTS].nonce;
+}
+
+int get_epoch(struct encrypt_ctx *ctx) {
+    return ctx->epoch;
+}
+
+long long get_offset(struct encrypt_ctx *ctx) {
+    return ctx->block_offset;
+}
+
+int get_spans(struct encrypt_ctx *ctx, struct block_span *spans) {
+    memcpy(spans, ctx->spans, sizeof(struct block_span) * ctx->span_count);
+    return ctx->span_count;
+}
+
+void log_counts(struct encrypt_ctx *ctx) {
+    epoch_finish(&ctx->epochs);
+    // the logger is idle now, the last job's index goes out with its last record
+    struct job *job = &ctx->jobs[ctx->log_job % JOB_SLOTS];
+    if (job->index) {
+        fflush(job->index);
+    }
+}
+
+// characters handled per step of the block counters, small enough to stay in L1
+#define FUSED_TILE 1024
+
+// lanes are folded once this many characters could be in a single lane entry
+#define LANE_LIMIT (UINT_MAX - FUSED_TILE)
+
+// len is at most FUSED_TILE
+static void count_input_tile(struct encrypt_ctx *ctx, struct count_shard *shard, const char *buf, size_t len) {
+    if (shard->input_lane_total > LANE_LIMIT) {
+        epoch_fold(shard);
+    }
+    ctx->engine->count_block(shard->input_lane_counts, buf, len);
+    shard->input_lane_total += len;
+    shard->input_total_count += len;
+}
+
+static void count_output_tile(struct encrypt_ctx *ctx, struct count_shard *shard, const char *buf, size_t len) {
+    if (shard->output_lane_total > LANE_LIMIT) {
+        epoch_fold(shard);
+    }
+    ctx->engine->count_block(shard->output_lane_counts, buf, len);
+    shard->output_lane_total += len;
+    shard->output_total_count += len;
+}
+
+// single characters go through the engine's block counter like everything else
+int count_input(struct encrypt_ctx *ctx, int c) {
+    char ch = c;
+    return count_input_block(ctx, &ch, 1, ctx->epoch);
+}
+
+int count_output(struct encrypt_ctx *ctx, int c) {
+    char ch = c;
+    return count_output_block(ctx, &ch, 1, ctx->epoch);
+}
+
+int count_input_block(struct encrypt_ctx *ctx, const char *buf, size_t len, int e) {
+    struct count_shard *shard = epoch_shard(epoch_count_input(&ctx->epochs, e));
+    if (!shard) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i += FUSED_TILE) {
+        count_input_tile(ctx, shard, buf + i, len - i < FUSED_TILE ? len - i : FUSED_TILE);
+    }
+    return 1;
+}
+
+int count_output_block(struct encrypt_ctx *ctx, const char *buf, size_t len, int e) {
+    struct count_shard *shard = epoch_shard(epoch_count_output(&ctx->epochs, e));
+    if (!shard) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i += FUSED_TILE) {
+        count_output_tile(ctx, shard, buf + i, len - i < FUSED_TILE ? len - i : FUSED_TILE);
+    }
+    return 1;
+}
+
+int encrypt_count_block(struct encrypt_ctx *ctx, const char *in, char *out, size_t len, int k, long long offset,
+                        const unsigned char *nonce, int e) {
+    // the epoch is only finished by count_finished(), so several threads may be in here
+    struct count_shard *shard = epoch_shard(epoch_set(&ctx->epochs, e));
+    if (!shard) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i += FUSED_TILE) {
+        size_t tile = len - i < FUSED_TILE ? len - i : FUSED_TILE;
+        count_input_tile(ctx, shard, in + i, tile);
+        encrypt_block(ctx, in + i, out + i, tile, k, offset + i, nonce);
+        count_output_tile(ctx, shard, out + i, tile);
+    }
+    return 1;
+}
+
+void count_finished(struct encrypt_ctx *ctx, int e) {
+    epoch_count_input(&ctx->epochs, e);
+    epoch_count_output(&ctx->epochs, e);
+}
+
+void count_whole_epoch(struct encrypt_ctx *ctx, int e) {
+    epoch_retire(&ctx->epochs, e);
+}
+
+long long get_input_count(struct encrypt_ctx *ctx, int c) {
+    return epoch_input_count(epoch_input_set(&ctx->epochs), (unsigned char)c);
+}
+
+long long get_output_count(struct encrypt_ctx *ctx, int c) {
+    return epoch_output_count(epoch_output_set(&ctx->epochs), (unsigned char)c);
+}
+
+long long get_input_total_count(struct encrypt_ctx *ctx) {
+    return epoch_input_total(epoch_input_set(&ctx->epochs));
+}
+
+long long get_output_total_count(struct encrypt_ctx *ctx) {
+    return epoch_output_total(epoch_output_set(&ctx->epochs));
+}
@@ -1,28 +1,283 @@
 #ifndef ENCRYPT_H
 #define ENCRYPT_H
 
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* All state of the module lives in a context, one per pipeline, and every
+ * function below takes it first. Pipelines in one process run independently
+ * of each other, each with its own files, key, epochs, logger and arena.
+ */
+struct encrypt_ctx;
+struct arena;
+
+/* The part of a block read in one key epoch. A block that goes on past a
+ * reset point has one span per epoch it reaches, in read order.
+ */
+struct block_span {
+    int length; // characters, the spans of a block add up to its length
+    int key;    // the key the span is encrypted with
+    int epoch;  // the epoch its characters are counted into
+    int whole;  // set when the span is all of its epoch, no other block has any of it
+    int last;   // set when nothing of its epoch comes after it, it ends on the reset
+                // point or the input ended
+};
+
+/* Returns a new context, or NULL if there is no memory for it. owner is handed
+ * back by encrypt_ctx_owner(), so the callbacks below can find their pipeline.
+ */
+struct encrypt_ctx *encrypt_ctx_new(void *owner);
+/* Stops the context's logger and frees everything it holds, call after
+ * log_counts() and once its threads are done with it.
+ */
+void encrypt_ctx_free(struct encrypt_ctx *ctx);
+void *encrypt_ctx_owner(struct encrypt_ctx *ctx);
+/* The arena the context's count sets come from, the pipeline may allocate its
+ * buffers from it too. It goes away with the context.
+ */
+struct arena *encrypt_ctx_arena(struct encrypt_ctx *ctx);
+/* Why the last call that returned an error failed, such as "name: reason" for
+ * a file init() could not open. The module never ends the process itself, its
+ * caller decides what an error means for the run.
+ */
+const char *encrypt_ctx_error(struct encrypt_ctx *ctx);
+
 /* You must implement this function.
- * When the function returns the encryption module is allowed to reset.
+ * When the function returns the encryption module is allowed to reset. It is
+ * called from the thread reading input.
  */
-void reset_requested();
+void reset_requested(struct encrypt_ctx *ctx);
 /* You must implement this function.
  * The function is called after the encryption module has finished a reset.
  */
-void reset_finished();
+void reset_finished(struct encrypt_ctx *ctx);
 
 /* You must use these functions to perform all I/O, encryption and counting
  * operations.
  */
-void init(char *inputFileName, char *outputFileName, char *logFileName);
-int read_input();
-void write_output(int c);
-void log_counts();
-int encrypt(int c);
-void count_input(int c);
-void count_output(int c);
-int get_input_count(int c);
-int get_output_count(int c);
-int get_input_total_count();
-int get_output_total_count();
+/* Opens the files. A name of "-" stands for stdin, stdout or, for the log,
+ * stderr, so the pipeline can sit in the middle of a shell pipe.
+ * Called again, from the thread reading input once it has read the end of the
+ * current input, it opens the next job of a batch: reading goes on with the
+ * new input right away, from offset 0 with the initial key and in an epoch of
+ * its own. Output keeps going to the previous job's file until the writer
+ * calls finish_output(), and each epoch is logged to the log of its job.
+ * Returns 0 if the job cannot be opened, such as when one of its files does
+ * not open or a stream cipher gets no nonce or key index for it, with the
+ * reason in encrypt_ctx_error(). No job is opened then and the context stays as it
+ * was, apart from the previous input being closed, so init() may go on to the
+ * next job of the batch.
+ */
+int init(struct encrypt_ctx *ctx, char *inputFileName, char *outputFileName, char *logFileName);
+/* Sets how many threads will count into the context, 2 unless changed, so
+ * that the epoch count sets get a shard for each of them and no more. Call
+ * before init(), returns 0 for fewer than 1 or more than EPOCH_SHARDS threads.
+ */
+int set_count_threads(struct encrypt_ctx *ctx, int threads);
+/* How many spans a block of len characters may need, at least 1 and at most
+ * what set_block_spans() takes.
+ */
+int block_spans(struct encrypt_ctx *ctx, int len);
+/* Lets the blocks read from now on go on past reset points, over as many as
+ * spans epochs, 1 unless changed so that every block ends on the next reset
+ * point. Call before init(), returns 0 for fewer than 1 or more spans than
+ * block_spans() ever gives.
+ */
+int set_block_spans(struct encrypt_ctx *ctx, int spans);
+/* The most characters a block read of len characters can return with
+ * set_block_spans(block_spans(len)) in place: len itself up to an epoch, past
+ * that the whole epochs that fit in it. Needs no context, so buffers can be
+ * sized from it before there is one.
+ */
+int block_reach(int len);
+/* Selects the cipher engine by name (see encrypt-engine.h) before init(),
+ * returns 0 if there is no such engine or it cannot be set up, such as a
+ * stream cipher without ENCRYPT_KEY. Each module has its own default.
+ */
+int select_engine(struct encrypt_ctx *ctx, const char *name);
+/* Reads one character as an unsigned char, or EOF at the end of input, so
+ * every byte value can be told apart from the end. On streamed input it must
+ * not be mixed with the block readers below, which bypass stdio. The block
+ * readers return lengths and never mark the end in the data itself.
+ */
+int read_input(struct encrypt_ctx *ctx);
+/* Reads up to len characters into buf and returns how many were read, 0 at
+ * end of input. A block read inside an epoch is cut short so that it ends
+ * exactly on its reset point. One read from the start of an epoch may go on
+ * over the resets after it, up to set_block_spans() epochs, and then ends on
+ * the last reset point it reaches, so its epochs are all whole but where the
+ * input ends first. On streamed input a block also ends once a read returns
+ * less than len, so a slow producer does not hold back what it has already
+ * sent. The resets inside a block are done on the way and the one it ends on
+ * by the next call before it reads anything. get_spans() tells which key and
+ * epoch each part of the block has. A reset does not wait for blocks of
+ * earlier epochs still in flight.
+ */
+int read_input_block(struct encrypt_ctx *ctx, char *buf, int len);
+/* Set when init() could map the input file, regular files are mapped and
+ * streams such as pipes are read with read(2).
+ */
+int input_mapped(struct encrypt_ctx *ctx);
+/* Same as read_input_block() without copying: points *block at the next len
+ * characters inside the mapped input. Only valid if input_mapped(), the data
+ * stays readable until init() opens the next job.
+ */
+int read_input_view(struct encrypt_ctx *ctx, const char **block, int len);
+void write_output(struct encrypt_ctx *ctx, int c);
+/* Write whole blocks with write(2)/writev(2) instead of stdio, count blocks
+ * going out in a single call where possible.
+ */
+void write_output_block(struct encrypt_ctx *ctx, const char *buf, size_t len);
+void write_output_blocks(struct encrypt_ctx *ctx, const struct iovec *blocks, int count);
+/* Switches the output file to O_DIRECT, staging writes in an aligned buffer.
+ * Returns 0 if the file system or file does not allow it.
+ */
+int enable_direct_output(struct encrypt_ctx *ctx);
+/* Writes out anything still buffered, call once after the last block. Returns
+ * 0 if io_uring output failed, see below.
+ */
+int flush_output(struct encrypt_ctx *ctx);
+/* Flushes and closes the current output file after a job's last block and
+ * moves on to the output of the next job init() opened. Not for use with
+ * direct or io_uring output.
+ */
+void finish_output(struct encrypt_ctx *ctx);
+
+/* io_uring backend. enable_async_io() sets up rings of depth requests for a
+ * regular input file (instead of mapping it) and a regular output file, and
+ * returns 0 if neither could use it. input_async()/output_async() tell which
+ * side did, the other side keeps the blocking calls above.
+ *
+ * read_input_submit() queues a read of the next block into buf and returns
+ * the length queued, 0 once the end of input is reached. read_input_complete()
+ * waits for the oldest queued read and returns its length, with the same
+ * reset handling as read_input_block(). write_output_submit() queues a write of
+ * up to IOV_MAX blocks after everything queued before, their data has to stay
+ * untouched until write_output_complete() returned for it. At most depth requests
+ * may be outstanding in each direction, completions come back in submission
+ * order.
+ * If the kernel fails a submission or a wait, the reads return -1 and the
+ * writes 0 with the reason in encrypt_ctx_error(). The ring is of no further
+ * use then, and neither is the job.
+ */
+int enable_async_io(struct encrypt_ctx *ctx, int depth);
+int input_async(struct encrypt_ctx *ctx);
+int output_async(struct encrypt_ctx *ctx);
+int read_input_submit(struct encrypt_ctx *ctx, char *buf, int len);
+int read_input_complete(struct encrypt_ctx *ctx);
+int write_output_submit(struct encrypt_ctx *ctx, const struct iovec *blocks, int count);
+int write_output_complete(struct encrypt_ctx *ctx);
+/* Writes the log in the compact binary format of encrypt-binlog.h instead of
+ * text, encrypt-logdecode turns it back into text. Call right after init(),
+ * and after enable_decrypt() when decrypting so the header says so. Returns 0
+ * if the module has no log file.
+ */
+int enable_binary_log(struct encrypt_ctx *ctx);
+/* Writes a key index (see encrypt-index.h) next to the log of every job, named
+ * after the log with ".idx" appended. It holds the job's nonce, the stream
+ * ciphers cannot be decrypted without it. Call right after init(), returns 0
+ * if the log is a standard stream or the index cannot be created.
+ */
+int enable_key_index(struct encrypt_ctx *ctx);
+/* Set when the selected engine encrypts under the file nonce, so that its
+ * output can only be decrypted with the key index of the run.
+ */
+int needs_key_index(struct encrypt_ctx *ctx);
+/* Switches a single job to decrypting the output of an earlier run: resets fall
+ * where the records of the key index index_name start and every epoch takes the
+ * key of its record, so every span gets the key it was encrypted with, and the
+ * job takes the nonce of the index. encrypt(),
+ * encrypt_block() and encrypt_count_block() apply the engine's inverse from then
+ * on and the log counts the ciphertext as input. Call right after init() and
+ * before enable_binary_log(), returns 0 if index_name is not a key index.
+ */
+int enable_decrypt(struct encrypt_ctx *ctx, const char *index_name);
+/* Limits a decrypting job to the length characters from offset on: the next
+ * read starts there, in the epoch the index has for it, and the input ends after
+ * them. For regular files only and before enable_async_io(), returns 0
+ * otherwise.
+ */
+int seek_input(struct encrypt_ctx *ctx, long long offset, long long length);
+/* Finishes the counts of every epoch and waits until all of them are logged.
+ * Each epoch is logged on its own once both sides are done counting it, so
+ * this is only needed once after the last block.
+ */
+void log_counts(struct encrypt_ctx *ctx);
+/* Encrypts one character with the current key, exactly as encrypt_block()
+ * would. Returns it as an unsigned char, never EOF.
+ */
+int encrypt(struct encrypt_ctx *ctx, int c);
+/* Encrypts len characters from in into out with the given key, giving exactly
+ * what encrypt() gives for each of them while that key is current. offset is
+ * the input position of in[0] and nonce the one get_nonce() gave for its job,
+ * stream ciphers take their keystream from them so blocks can be encrypted in
+ * any order. The shift
+ * engine uses AVX2 or NEON where available and a per-key lookup table
+ * otherwise, ENCRYPT_SIMD=scalar|table|sse2 forces a different kernel.
+ */
+void encrypt_block(struct encrypt_ctx *ctx, const char *in, char *out, size_t len, int key, long long offset,
+                   const unsigned char *nonce);
+/* Undoes encrypt_block() for the same key, offset and nonce, whichever way the
+ * context runs. Exact for every character the engine maps one to one: all of
+ * them for the stream ciphers and for caesar up to key 26, the printable range
+ * but '~' for shift.
+ */
+void decrypt_block(struct encrypt_ctx *ctx, const char *in, char *out, size_t len, int key, long long offset,
+                   const unsigned char *nonce);
+/* The key encrypt() currently uses, that of the last span of the block read
+ * last.
+ */
+int get_key(struct encrypt_ctx *ctx);
+/* The random nonce of the job being read, ENGINE_NONCE_SIZE bytes that stay
+ * in place until the job's output is written and its log is finished. A
+ * decrypting job has the nonce of its key index.
+ */
+const unsigned char *get_nonce(struct encrypt_ctx *ctx);
+/* The epoch of the last span of the block read last, it goes up by one with
+ * every reset.
+ */
+int get_epoch(struct encrypt_ctx *ctx);
+/* Input offset of the first character of the block read last. */
+long long get_offset(struct encrypt_ctx *ctx);
+/* Copies the spans of the block read last into spans, which has room for
+ * set_block_spans() of them, and returns how many there are. A block with
+ * nothing in it has one empty span in the current epoch.
+ */
+int get_spans(struct encrypt_ctx *ctx, struct block_span *spans);
+/* Count into the current epoch. The counting calls return 1,
+ * or 0 without counting when the calling thread is one more than
+ * set_count_threads() allowed to count into the context.
+ */
+int count_input(struct encrypt_ctx *ctx, int c);
+int count_output(struct encrypt_ctx *ctx, int c);
+/* Count every character of a span into the counts of the epoch it was read
+ * in, indexed as unsigned char. Cheaper than calling count_input()/
+ * count_output() per character. Each side must see its spans in read order.
+ */
+int count_input_block(struct encrypt_ctx *ctx, const char *buf, size_t len, int epoch);
+int count_output_block(struct encrypt_ctx *ctx, const char *buf, size_t len, int epoch);
+/* Same as count_input_block(in), encrypt_block() and count_output_block(out)
+ * in a single pass, each character is loaded once while it is in cache. As many
+ * threads as set_count_threads() allows may run it at once on spans in any
+ * order, each counts into its own shard. The counts of a span only reach its
+ * epoch's log once count_finished() was called past that epoch, in read order,
+ * or count_whole_epoch() for a whole span. count_finished(epoch) finishes the
+ * epochs before epoch, so after a block it is called for the epoch of its last
+ * span, or the one after it when that span is the last of its epoch.
+ */
+int encrypt_count_block(struct encrypt_ctx *ctx, const char *in, char *out, size_t len, int key, long long offset,
+                        const unsigned char *nonce, int epoch);
+void count_finished(struct encrypt_ctx *ctx, int epoch);
+/* Lets the epoch of a whole span be logged as soon as encrypt_count_block() is
+ * done with it, before count_finished() gets there. Blocks that go on over
+ * more resets than there are count sets need it, or they would wait for sets
+ * only their own epochs can free.
+ */
+void count_whole_epoch(struct encrypt_ctx *ctx, int epoch);
+/* Counts are 64 bits wide, summed over every counting thread on each call. */
+long long get_input_count(struct encrypt_ctx *ctx, int c);
+long long get_output_count(struct encrypt_ctx *ctx, int c);
+long long get_input_total_count(struct encrypt_ctx *ctx);
+long long get_output_total_count(struct encrypt_ctx *ctx);
 
 #endif // ENCRYPT_H
\ No newline at end of file
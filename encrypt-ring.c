@@ -0,0 +1,225 @@
+#include "encrypt-ring.h"
+
+#ifdef RING_LOCKFREE
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// upper bound for the spin budget, adapted per waiting thread
+#define RING_SPIN_MAX 4096
+
+static int ring_spin_max = -1;
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// blocks until the cursor no longer holds seen, spinning first while that tends to pay off
+static void cursor_wait(struct ring_cursor* c, unsigned int seen, int* spin) {
+    for (int i = 0; i < *spin; i++) {
+        if (atomic_load_explicit(&c->value, memory_order_acquire) != seen) {
+            *spin += *spin / 2 + 1;
+            if (*spin > ring_spin_max) *spin = ring_spin_max;
+            return;
+        }
+        cpu_relax();
+    }
+
+    // the waiter count is raised before the value is checked again, so an advance
+    // either sees a waiter or the futex sees the new value
+    atomic_fetch_add(&c->waiters, 1);
+    while (atomic_load(&c->value) == seen) {
+        syscall(SYS_futex, (void*)&c->value, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    }
+    atomic_fetch_sub(&c->waiters, 1);
+    *spin /= 2;
+}
+
+// moves the cursor forward by one slot, waking sleepers only if there are any
+static void cursor_advance(struct ring_cursor* c) {
+    atomic_fetch_add(&c->value, 1);
+    if (atomic_load(&c->waiters) > 0) {
+        syscall(SYS_futex, (void*)&c->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+static void private_init(struct ring_private* p) {
+    p->position = 0;
+    p->cached = 0;
+    p->slot = 0;
+    p->spin = ring_spin_max;
+}
+
+void ring_init(struct ring* r, int size, int consumers) {
+    // spinning only helps when the other side runs on another core
+    if (ring_spin_max < 0) {
+        ring_spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN_MAX : 0;
+    }
+    r->size = size;
+    r->consumers = consumers;
+    atomic_init(&r->head.value, 0);
+    atomic_init(&r->head.waiters, 0);
+    private_init(&r->producer);
+    for (int i = 0; i < consumers; i++) {
+        atomic_init(&r->tail[i].value, 0);
+        atomic_init(&r->tail[i].waiters, 0);
+        private_init(&r->consumer[i]);
+    }
+}
+
+void ring_destroy(struct ring* r) {
+    (void)r;
+}
+
+int ring_acquire(struct ring* r) {
+    struct ring_private* p = &r->producer;
+    unsigned int size = r->size;
+
+    // the cached value is the slowest consumer as of the last check
+    if (p->position - p->cached >= size) {
+        unsigned int slowest = p->position;
+        for (int i = 0; i < r->consumers; i++) {
+            unsigned int t;
+            while (p->position - (t = atomic_load_explicit(&r->tail[i].value, memory_order_acquire)) >= size) {
+                cursor_wait(&r->tail[i], t, &p->spin);
+            }
+            if (p->position - t > p->position - slowest) slowest = t;
+        }
+        p->cached = slowest;
+    }
+
+    int slot = p->slot;
+    p->slot = (p->slot + 1) % r->size;
+    p->position++;
+    return slot;
+}
+
+int ring_try_acquire(struct ring* r) {
+    struct ring_private* p = &r->producer;
+    unsigned int size = r->size;
+    if (p->position - p->cached >= size) {
+        unsigned int slowest = p->position;
+        for (int i = 0; i < r->consumers; i++) {
+            unsigned int t = atomic_load_explicit(&r->tail[i].value, memory_order_acquire);
+            if (p->position - t >= size) return -1;
+            if (p->position - t > p->position - slowest) slowest = t;
+        }
+        p->cached = slowest;
+    }
+
+    int slot = p->slot;
+    p->slot = (p->slot + 1) % r->size;
+    p->position++;
+    return slot;
+}
+
+void ring_publish(struct ring* r) {
+    cursor_advance(&r->head);
+}
+
+int ring_next(struct ring* r, int consumer) {
+    struct ring_private* p = &r->consumer[consumer];
+    if (p->position == p->cached) {
+        unsigned int h;
+        while ((h = atomic_load_explicit(&r->head.value, memory_order_acquire)) == p->position) {
+            cursor_wait(&r->head, h, &p->spin);
+        }
+        p->cached = h;
+    }
+    int slot = p->slot;
+    p->slot = (p->slot + 1) % r->size;
+    p->position++;
+    return slot;
+}
+
+int ring_try_next(struct ring* r, int consumer) {
+    struct ring_private* p = &r->consumer[consumer];
+    if (p->position == p->cached) {
+        p->cached = atomic_load_explicit(&r->head.value, memory_order_acquire);
+        if (p->position == p->cached) return -1;
+    }
+    int slot = p->slot;
+    p->slot = (p->slot + 1) % r->size;
+    p->position++;
+    return slot;
+}
+
+void ring_release(struct ring* r, int consumer) {
+    cursor_advance(&r->tail[consumer]);
+}
+
+#else
+
+void ring_init(struct ring* r, int size, int consumers) {
+    r->size = size;
+    r->consumers = consumers;
+    r->in = 0;
+    for (int i = 0; i < consumers; i++) {
+        // every slot starts out free
+        sem_init(&r->data_ready[i], 0, 0);
+        sem_init(&r->slot_free[i], 0, size);
+        r->out[i] = 0;
+    }
+}
+
+void ring_destroy(struct ring* r) {
+    for (int i = 0; i < r->consumers; i++) {
+        sem_destroy(&r->data_ready[i]);
+        sem_destroy(&r->slot_free[i]);
+    }
+}
+
+int ring_acquire(struct ring* r) {
+    for (int i = 0; i < r->consumers; i++) {
+        sem_wait(&r->slot_free[i]);
+    }
+    int slot = r->in;
+    r->in = (r->in + 1) % r->size;
+    return slot;
+}
+
+int ring_try_acquire(struct ring* r) {
+    for (int i = 0; i < r->consumers; i++) {
+        if (sem_trywait(&r->slot_free[i]) != 0) {
+            // give back what was taken from the consumers before
+            while (--i >= 0) {
+                sem_post(&r->slot_free[i]);
+            }
+            return -1;
+        }
+    }
+    int slot = r->in;
+    r->in = (r->in + 1) % r->size;
+    return slot;
+}
+
+void ring_publish(struct ring* r) {
+    for (int i = 0; i < r->consumers; i++) {
+        sem_post(&r->data_ready[i]);
+    }
+}
+
+int ring_next(struct ring* r, int consumer) {
+    sem_wait(&r->data_ready[consumer]);
+    int slot = r->out[consumer];
+    r->out[consumer] = (r->out[consumer] + 1) % r->size;
+    return slot;
+}
+
+int ring_try_next(struct ring* r, int consumer) {
+    if (sem_trywait(&r->data_ready[consumer]) != 0) return -1;
+    int slot = r->out[consumer];
+    r->out[consumer] = (r->out[consumer] + 1) % r->size;
+    return slot;
+}
+
+void ring_release(struct ring* r, int consumer) {
+    sem_post(&r->slot_free[consumer]);
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef ENCRYPT_RING_H
+#define ENCRYPT_RING_H
+
+/* Bounded ring of slot indices with one producer and up to RING_MAX_CONSUMERS
+ * consumers. Every consumer sees every slot, and a slot only becomes free for
+ * the producer again once all consumers have released it. The ring does not
+ * own the slot contents, callers keep their own arrays indexed by slot.
+ *
+ * By default the ring is built on POSIX counting semaphores. Building with
+ * -DRING_LOCKFREE (make RING=lockfree) switches to C11 atomic cursors, each on
+ * its own cache line, with an adaptive spin-then-futex wait.
+ */
+
+#include <stdatomic.h>
+#ifndef RING_LOCKFREE
+#include <semaphore.h>
+#endif
+
+#define RING_MAX_CONSUMERS 2
+#define RING_CACHE_LINE 64
+
+#ifdef RING_LOCKFREE
+// a cursor shared between threads, alone on its cache line
+struct ring_cursor {
+    _Alignas(RING_CACHE_LINE) atomic_uint value;
+    atomic_uint waiters;
+};
+
+// state only touched by the thread that owns it, kept off the shared lines
+struct ring_private {
+    _Alignas(RING_CACHE_LINE) unsigned int position; // slots acquired or taken by ring_next() so far
+    unsigned int cached;                             // last seen value of the cursor waited on
+    int slot;                                        // position modulo the ring size
+    int spin;                                        // current spin budget before sleeping
+};
+#endif
+
+struct ring {
+    int size;
+    int consumers;
+#ifdef RING_LOCKFREE
+    struct ring_cursor head;                         // slots published by the producer
+    struct ring_cursor tail[RING_MAX_CONSUMERS];     // slots released by each consumer
+    struct ring_private producer;
+    struct ring_private consumer[RING_MAX_CONSUMERS];
+#else
+    sem_t data_ready[RING_MAX_CONSUMERS]; // slots each consumer has not processed yet
+    sem_t slot_free[RING_MAX_CONSUMERS];  // slots each consumer has released
+    int in;
+    int out[RING_MAX_CONSUMERS];
+#endif
+};
+
+void ring_init(struct ring* r, int size, int consumers);
+void ring_destroy(struct ring* r);
+
+/* Producer side: waits for a slot every consumer has released and returns its
+ * index. ring_publish() hands the oldest unpublished slot to the consumers.
+ * The same serialization rules as for consumers apply to several producer
+ * threads.
+ */
+int ring_acquire(struct ring* r);
+/* Same as ring_acquire() but returns -1 instead of waiting if no slot is free. */
+int ring_try_acquire(struct ring* r);
+void ring_publish(struct ring* r);
+
+/* Consumer side: waits for the next published slot and returns its index.
+ * ring_release() hands back the oldest slot the consumer has not released
+ * yet, so a consumer may hold several slots at once. Several threads may act
+ * as one consumer as long as their ring_next() calls are serialized and so
+ * are their ring_release() calls.
+ */
+int ring_next(struct ring* r, int consumer);
+/* Same as ring_next() but returns -1 instead of waiting if nothing is published. */
+int ring_try_next(struct ring* r, int consumer);
+void ring_release(struct ring* r, int consumer);
+
+#endif // ENCRYPT_RING_H
@@ -0,0 +1,87 @@
+#include "encrypt-stats.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static struct stage_stats stages[STATS_MAX_STAGES];
+static int stage_count = 0;
+static pthread_mutex_t stages_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct stage_stats *stats_stage(const char *name) {
+    pthread_mutex_lock(&stages_lock);
+    struct stage_stats *stage = &stages[STATS_MAX_STAGES - 1];
+    if (stage_count < STATS_MAX_STAGES) {
+        stage = &stages[stage_count++];
+        strncpy(stage->name, name, sizeof(stage->name) - 1);
+    } else {
+        strcpy(stage->name, "others");
+    }
+    pthread_mutex_unlock(&stages_lock);
+    return stage;
+}
+
+long long stats_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static long long get(atomic_llong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void stats_print(FILE *out) {
+    pthread_mutex_lock(&stages_lock);
+    fprintf(out, "%-20s %10s %14s %14s %14s %8s %12s\n", "stage", "blocks", "bytes", "data wait ms",
+            "slot wait ms", "resets", "reset ms");
+    for (int i = 0; i < stage_count; i++) {
+        struct stage_stats *s = &stages[i];
+        fprintf(out, "%-20s %10lld %14lld %14.3f %14.3f %8lld %12.3f\n", s->name, get(&s->blocks),
+                get(&s->bytes), get(&s->data_wait_ns) / 1e6, get(&s->slot_wait_ns) / 1e6, get(&s->resets),
+                get(&s->reset_ns) / 1e6);
+    }
+    pthread_mutex_unlock(&stages_lock);
+    fflush(out);
+}
+
+int stats_sum(const char *name, struct stage_stats *sum) {
+    int count = 0;
+    memset(sum, 0, sizeof(*sum));
+    pthread_mutex_lock(&stages_lock);
+    for (int i = 0; i < stage_count; i++) {
+        struct stage_stats *s = &stages[i];
+        if (strcmp(s->name, name) == 0) {
+            sum->blocks += get(&s->blocks);
+            sum->bytes += get(&s->bytes);
+            sum->data_wait_ns += get(&s->data_wait_ns);
+            sum->slot_wait_ns += get(&s->slot_wait_ns);
+            sum->resets += get(&s->resets);
+            sum->reset_ns += get(&s->reset_ns);
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&stages_lock);
+    return count;
+}
+
+static sigset_t usr1;
+
+// takes every SIGUSR1 sent to the process, so printing runs outside a signal handler
+static void *signalThread() {
+    int sig;
+    while (sigwait(&usr1, &sig) == 0) {
+        stats_print(stderr);
+    }
+    return NULL;
+}
+
+void stats_on_signal() {
+    pthread_t pid;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    pthread_create(&pid, NULL, &signalThread, NULL);
+    pthread_detach(pid);
+}
@@ -0,0 +1,64 @@
+#ifndef ENCRYPT_STATS_H
+#define ENCRYPT_STATS_H
+
+/* Per-stage counters, built in with -DENCRYPT_STATS (make STATS=1) and left
+ * out of release builds entirely. Every pipeline thread registers a stage of
+ * its own and is the only one to write it, the counters sit on the stage's
+ * own cache lines and are written with plain relaxed stores, so they cost no
+ * locked instructions. They can be read at any time, stats_print() does so
+ * on SIGUSR1 and once more at exit.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+// stages with counters of their own, threads registering after that share the last one
+#define STATS_MAX_STAGES 64
+
+struct stage_stats {
+    _Alignas(64) char name[32];
+    atomic_llong blocks;
+    atomic_llong bytes;
+    atomic_llong data_wait_ns; // waiting for a block to take
+    atomic_llong slot_wait_ns; // waiting for a free slot to fill
+    atomic_llong resets;
+    atomic_llong reset_ns;     // between reset_requested() and reset_finished()
+};
+
+/* Registers a stage for the calling thread and returns its counters. */
+struct stage_stats *stats_stage(const char *name);
+
+/* Monotonic clock in nanoseconds. */
+long long stats_now();
+
+/* Adds to a counter of the caller's own stage. */
+static inline void stats_add(atomic_llong *counter, long long amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+/* Counts one block of len characters done by stage, the empty block at the
+ * end of input does not count.
+ */
+static inline void stats_block(struct stage_stats *stage, long long len) {
+    if (len > 0) {
+        stats_add(&stage->blocks, 1);
+        stats_add(&stage->bytes, len);
+    }
+}
+
+/* Prints every stage as one row of a table. */
+void stats_print(FILE *out);
+
+/* Adds up the counters of every stage called name into sum and returns how
+ * many there are, for threads other than the stages' own.
+ */
+int stats_sum(const char *name, struct stage_stats *sum);
+
+/* Prints the stages to stderr whenever the process gets SIGUSR1. Call before
+ * creating the pipeline threads: SIGUSR1 is blocked in the caller, and so in
+ * every thread it creates, and taken by a thread of its own.
+ */
+void stats_on_signal();
+
+#endif // ENCRYPT_STATS_H
@@ -0,0 +1,49 @@
+#include "encrypt-table.h"
+
+void table_build(struct cipher_table *t, int (*cipher)(int c, int key), int key) {
+    for (int i = 0; i < 256; i++) {
+        // the block kernels see plain chars, so index by the char's own value
+        t->map[i] = cipher((char)i, key);
+    }
+    t->key = key;
+}
+
+// how much a character is preferred as the one a shared image goes back to
+static int preference(int c) {
+    return c >= 32 && c <= 126 ? 2 : c < 128 ? 1 : 0;
+}
+
+void table_invert(struct cipher_table *inverse, const struct cipher_table *t) {
+    for (int i = 0; i < 256; i++) {
+        inverse->map[i] = i;
+    }
+    // the preferred preimages are written last, the lowest of a rank last of all
+    for (int rank = 0; rank <= 2; rank++) {
+        for (int i = 255; i >= 0; i--) {
+            if (preference(i) == rank) {
+                inverse->map[t->map[i]] = i;
+            }
+        }
+    }
+    inverse->key = t->key;
+}
+
+void table_encrypt(const struct cipher_table *t, const char *in, char *out, size_t len) {
+    const unsigned char *p = (const unsigned char *)in;
+    unsigned char *q = (unsigned char *)out;
+    size_t i = 0;
+    // independent lookups so several loads are in flight at once
+    for (; i + 8 <= len; i += 8) {
+        q[i] = t->map[p[i]];
+        q[i + 1] = t->map[p[i + 1]];
+        q[i + 2] = t->map[p[i + 2]];
+        q[i + 3] = t->map[p[i + 3]];
+        q[i + 4] = t->map[p[i + 4]];
+        q[i + 5] = t->map[p[i + 5]];
+        q[i + 6] = t->map[p[i + 6]];
+        q[i + 7] = t->map[p[i + 7]];
+    }
+    for (; i < len; i++) {
+        q[i] = t->map[p[i]];
+    }
+}
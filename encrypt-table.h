@@ -0,0 +1,31 @@
+#ifndef ENCRYPT_TABLE_H
+#define ENCRYPT_TABLE_H
+
+/* Table-driven cipher kernel. Once the key is fixed, a cipher that maps every
+ * character on its own is just a 256 entry byte table, which is built once per
+ * key and then applied with one lookup per character instead of the cipher's
+ * arithmetic or branches.
+ */
+
+#include <stddef.h>
+
+struct cipher_table {
+    unsigned char map[256]; // indexed by the character as unsigned char
+    int key;
+};
+
+/* Fills t with cipher(c, key) for every char c. */
+void table_build(struct cipher_table *t, int (*cipher)(int c, int key), int key);
+
+/* Fills inverse with the table that undoes t. Where t maps several characters
+ * to one, that one goes back to a printable ASCII character if one of them is,
+ * else to another ASCII character, the lowest of them, so text mostly comes
+ * back the way it went in.
+ * Characters t never produces map to themselves.
+ */
+void table_invert(struct cipher_table *inverse, const struct cipher_table *t);
+
+/* Encrypts len characters from in into out through t. */
+void table_encrypt(const struct cipher_table *t, const char *in, char *out, size_t len);
+
+#endif // ENCRYPT_TABLE_H
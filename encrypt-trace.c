@@ -0,0 +1,123 @@
+#include "encrypt-trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// threads with a row of their own, later ones are not recorded
+#define TRACE_THREADS 64
+
+struct trace_record {
+    long long begin, end;
+    int what;
+    int arg;
+};
+
+struct trace_buffer {
+    char name[32];
+    struct trace_record *records;
+    int count;
+    long long dropped;
+};
+
+static const char *event_names[] = {
+    [TRACE_READ] = "read",
+    [TRACE_COUNT_INPUT] = "count input",
+    [TRACE_ENCRYPT] = "encrypt",
+    [TRACE_ENCRYPT_COUNT] = "encrypt and count",
+    [TRACE_COUNT_OUTPUT] = "count output",
+    [TRACE_WRITE] = "write",
+    [TRACE_RESET] = "reset",
+};
+
+static const char *event_args[] = {
+    [TRACE_READ] = "epoch",
+    [TRACE_COUNT_INPUT] = "epoch",
+    [TRACE_ENCRYPT] = "epoch",
+    [TRACE_ENCRYPT_COUNT] = "epoch",
+    [TRACE_COUNT_OUTPUT] = "epoch",
+    [TRACE_WRITE] = "blocks",
+    [TRACE_RESET] = "epoch",
+};
+
+static const char *trace_path = NULL;
+static long long trace_start;
+static struct trace_buffer buffers[TRACE_THREADS];
+static int buffer_count = 0;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct trace_buffer *buffer = NULL;
+
+long long trace_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+void trace_init() {
+    trace_path = getenv("ENCRYPT_TRACE");
+    trace_start = trace_now();
+}
+
+void trace_thread(const char *name) {
+    if (!trace_path) {
+        return;
+    }
+    pthread_mutex_lock(&buffers_lock);
+    if (buffer_count < TRACE_THREADS) {
+        struct trace_record *records = malloc(sizeof(struct trace_record) * TRACE_EVENTS);
+        if (records) {
+            buffer = &buffers[buffer_count++];
+            strncpy(buffer->name, name, sizeof(buffer->name) - 1);
+            buffer->records = records;
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+}
+
+void trace_span(enum trace_event what, long long begin, int arg) {
+    if (!buffer) {
+        return;
+    }
+    if (buffer->count == TRACE_EVENTS) {
+        buffer->dropped++;
+        return;
+    }
+    struct trace_record *r = &buffer->records[buffer->count++];
+    r->begin = begin;
+    r->end = trace_now();
+    r->what = what;
+    r->arg = arg;
+}
+
+void trace_dump() {
+    if (!trace_path) {
+        return;
+    }
+    FILE *out = fopen(trace_path, "w");
+    if (!out) {
+        fprintf(stderr, "Warning: cannot write the trace to %s\n", trace_path);
+        return;
+    }
+    // complete events ("X") in microseconds since trace_init(), one row per thread
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    const char *separator = "";
+    for (int t = 0; t < buffer_count; t++) {
+        struct trace_buffer *b = &buffers[t];
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                separator, t + 1, b->name);
+        separator = ",\n";
+        for (int i = 0; i < b->count; i++) {
+            struct trace_record *r = &b->records[i];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%d}}",
+                    event_names[r->what], t + 1, (r->begin - trace_start) / 1e3, (r->end - r->begin) / 1e3,
+                    event_args[r->what], r->arg);
+        }
+        if (b->dropped > 0) {
+            fprintf(stderr, "Warning: trace of %s dropped %lld events past %d\n", b->name, b->dropped, TRACE_EVENTS);
+        }
+        free(b->records);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+}
@@ -0,0 +1,43 @@
+#ifndef ENCRYPT_TRACE_H
+#define ENCRYPT_TRACE_H
+
+/* Timeline of the pipeline in the Chrome trace format, which chrome://tracing
+ * and ui.perfetto.dev open. Built in with -DENCRYPT_TRACE (make TRACE=1) and
+ * recorded only when ENCRYPT_TRACE names the file to write. Every thread
+ * records into a buffer of its own without any locking, the buffers are
+ * written out once the pipeline threads are done.
+ */
+
+// events kept per thread, later ones are dropped and counted
+#define TRACE_EVENTS (1 << 20)
+
+enum trace_event {
+    TRACE_READ,
+    TRACE_COUNT_INPUT,
+    TRACE_ENCRYPT,
+    TRACE_ENCRYPT_COUNT, // fused workers
+    TRACE_COUNT_OUTPUT,
+    TRACE_WRITE,
+    TRACE_RESET,
+};
+
+/* Starts recording if ENCRYPT_TRACE is set. Call before the threads start. */
+void trace_init();
+
+/* Gives the calling thread a buffer and a name for its row of the timeline. */
+void trace_thread(const char *name);
+
+/* Monotonic clock in nanoseconds. */
+long long trace_now();
+
+/* Records an event of the calling thread from begin until now. arg shows up
+ * with it, the epoch of a block or the number of blocks written at once.
+ */
+void trace_span(enum trace_event what, long long begin, int arg);
+
+/* Writes every thread's events to the ENCRYPT_TRACE file. Call once the
+ * threads that record are done.
+ */
+void trace_dump();
+
+#endif // ENCRYPT_TRACE_H
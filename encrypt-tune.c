@@ -0,0 +1,183 @@
+#include "encrypt-tune.h"
+#include "encrypt-stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+// share of a decision interval a stage has to wait before the tuner reacts to it
+#define TUNE_WAITS 0.05
+// share under which a wait counts as none at all
+#define TUNE_NO_WAIT 0.005
+// change in throughput that makes a block size step count as better or worse
+#define TUNE_STEP_GAIN 0.05
+
+void gate_init(struct depth_gate *g, int size, int depth, int consumers) {
+    sem_init(&g->credits, 0, size);
+    g->releases = calloc(size, sizeof(atomic_int));
+    g->positions[0] = g->positions[1] = 0;
+    g->consumers = consumers;
+    g->size = size;
+    g->held = 0;
+    atomic_init(&g->depth, size);
+    gate_resize(g, depth);
+}
+
+void gate_destroy(struct depth_gate *g) {
+    sem_destroy(&g->credits);
+    free(g->releases);
+}
+
+void gate_enter(struct depth_gate *g) {
+    while (sem_wait(&g->credits) != 0 && errno == EINTR) {
+    }
+}
+
+int gate_try_enter(struct depth_gate *g) {
+    return sem_trywait(&g->credits) == 0;
+}
+
+void gate_leave(struct depth_gate *g, int consumer) {
+    int slot = g->positions[consumer]++ % g->size;
+    // the last consumer done with the slot hands its credit back
+    if (atomic_fetch_add(&g->releases[slot], 1) == g->consumers - 1) {
+        atomic_store(&g->releases[slot], 0);
+        sem_post(&g->credits);
+    }
+}
+
+void gate_resize(struct depth_gate *g, int depth) {
+    depth = depth < 1 ? 1 : depth > g->size ? g->size : depth;
+    atomic_store(&g->depth, depth);
+    int held = g->size - depth;
+    while (g->held > held) {
+        sem_post(&g->credits);
+        g->held--;
+    }
+    // credits in use right now are taken back once their blocks are through
+    while (g->held < held && sem_trywait(&g->credits) == 0) {
+        g->held++;
+    }
+}
+
+int gate_depth(struct depth_gate *g) {
+    return atomic_load(&g->depth);
+}
+
+static struct tune_settings *tuned;
+static pthread_t tuner;
+static sem_t stopped;
+
+// counters of the stages the tuner steers by, summed over their threads
+struct tune_sample {
+    long long when;
+    struct stage_stats reader, workers, writer;
+    int worker_count;
+};
+
+static void sample(struct tune_sample *s) {
+    struct stage_stats fused;
+    s->when = stats_now();
+    stats_sum("reader", &s->reader);
+    stats_sum("writer", &s->writer);
+    s->worker_count = stats_sum("encryptor", &s->workers);
+    // only one of the two kinds of workers runs
+    int fused_count = stats_sum("fused worker", &fused);
+    if (fused_count > 0) {
+        s->workers = fused;
+        s->worker_count = fused_count;
+    }
+}
+
+// halves or doubles a depth, keeping two blocks in flight so no stage waits on every block
+static void step(struct depth_gate *g, int grow) {
+    int depth = grow ? gate_depth(g) * 2 : gate_depth(g) / 2;
+    gate_resize(g, depth < 2 ? 2 : depth);
+}
+
+// one decision from what the stages waited for since the last one
+static void decide(struct tune_sample *last, struct tune_sample *now) {
+    static int direction = 1;      // block size grows or shrinks while throughput improves
+    static double last_rate = 0;
+    double span = now->when - last->when;
+    double lanes = span * (now->worker_count > 0 ? now->worker_count : 1);
+    double reader_full = (now->reader.slot_wait_ns - last->reader.slot_wait_ns) / span;
+    double starved = (now->workers.data_wait_ns - last->workers.data_wait_ns) / lanes;
+    double blocked = (now->workers.slot_wait_ns - last->workers.slot_wait_ns) / lanes;
+    double writer_idle = (now->writer.data_wait_ns - last->writer.data_wait_ns) / span;
+    double rate = (now->reader.bytes - last->reader.bytes) / span;
+    if (rate == 0) {
+        // nothing moved, nothing to learn from
+        return;
+    }
+    // collects the credits an earlier shrink could not take yet
+    gate_resize(tuned->input, gate_depth(tuned->input));
+    gate_resize(tuned->output, gate_depth(tuned->output));
+
+    // workers waiting for output slots: the writer stalls, give it more room
+    if (blocked > TUNE_WAITS) {
+        step(tuned->output, 1);
+    } else if (writer_idle > 0.5 && blocked < TUNE_NO_WAIT) {
+        step(tuned->output, 0);
+    }
+
+    // reader and workers both waiting in turn: input comes in bursts, buffer more of it
+    if (reader_full > TUNE_WAITS && starved > TUNE_WAITS) {
+        step(tuned->input, 1);
+    } else if (reader_full > 0.5 && starved < TUNE_NO_WAIT) {
+        // the workers are behind, deeper input only adds latency
+        step(tuned->input, 0);
+    }
+
+    int block = atomic_load(tuned->block_size);
+    if (starved > 0.9 && reader_full < TUNE_NO_WAIT) {
+        // input trickles in, large blocks only hold it back
+        block /= 2;
+        direction = -1;
+    } else {
+        // climb towards the block size with the best throughput
+        if (last_rate > 0 && rate < last_rate * (1 - TUNE_STEP_GAIN)) {
+            direction = -direction;
+        } else if (last_rate > 0 && rate < last_rate * (1 + TUNE_STEP_GAIN)) {
+            direction = 0;
+        } else if (direction == 0) {
+            direction = 1;
+        }
+        block = direction > 0 ? block * 2 : direction < 0 ? block / 2 : block;
+    }
+    block = block < tuned->min_block ? tuned->min_block : block > tuned->max_block ? tuned->max_block : block;
+    atomic_store(tuned->block_size, block);
+    last_rate = rate;
+}
+
+static void *tunerThread() {
+    struct tune_sample samples[2];
+    int last = 0;
+    sample(&samples[last]);
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += tuned->interval_ms * 1000000LL;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        if (sem_timedwait(&stopped, &deadline) == 0) {
+            break;
+        }
+        sample(&samples[1 - last]);
+        decide(&samples[last], &samples[1 - last]);
+        last = 1 - last;
+    }
+    return NULL;
+}
+
+void tune_start(struct tune_settings *settings) {
+    tuned = settings;
+    sem_init(&stopped, 0, 0);
+    pthread_create(&tuner, NULL, tunerThread, NULL);
+}
+
+void tune_stop() {
+    sem_post(&stopped);
+    pthread_join(tuner, NULL);
+    sem_destroy(&stopped);
+}
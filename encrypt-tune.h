@@ -0,0 +1,61 @@
+#ifndef ENCRYPT_TUNE_H
+#define ENCRYPT_TUNE_H
+
+/* Auto-tuning of ring depth and block size (-a), built with the stage
+ * counters (make STATS=1) that it steers by.
+ *
+ * Rings keep the size they were made with. Depth is limited below it by a
+ * gate in front of the producer: every block in flight holds one of depth
+ * credits, and the last consumer to release a slot hands its credit back.
+ * The tuner changes the depth by holding back credits or returning them, so
+ * no thread ever waits for the tuner.
+ */
+
+#include <semaphore.h>
+#include <stdatomic.h>
+
+struct depth_gate {
+    sem_t credits;
+    atomic_int *releases;       // consumers done with each slot
+    unsigned int positions[2];  // slots released so far by each consumer, owned by it
+    int consumers;
+    int size;                   // the ring's size, the most depth can be
+    atomic_int depth;           // blocks allowed in flight
+    int held;                   // credits held back by the tuner, tuner only
+};
+
+void gate_init(struct depth_gate *g, int size, int depth, int consumers);
+void gate_destroy(struct depth_gate *g);
+
+/* Producer: waits for a credit before acquiring a slot. */
+void gate_enter(struct depth_gate *g);
+
+/* Producer: takes a credit if one is free and returns whether it did. */
+int gate_try_enter(struct depth_gate *g);
+
+/* Consumer: after each ring_release(), in the same order. */
+void gate_leave(struct depth_gate *g, int consumer);
+
+/* Tuner: sets the depth, between 1 and the ring's size. Credits in use are
+ * held back once their blocks come through, later calls collect them.
+ */
+void gate_resize(struct depth_gate *g, int depth);
+
+/* The depth last set. */
+int gate_depth(struct depth_gate *g);
+
+/* What the tuner steers and within which limits. */
+struct tune_settings {
+    struct depth_gate *input, *output;
+    atomic_int *block_size;     // length the reader asks for
+    int min_block, max_block;
+    int interval_ms;            // time between two decisions
+};
+
+/* Starts the tuner thread. */
+void tune_start(struct tune_settings *settings);
+
+/* Stops the tuner thread. */
+void tune_stop();
+
+#endif // ENCRYPT_TUNE_H
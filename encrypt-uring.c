@@ -0,0 +1,120 @@
+#include "encrypt-uring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+int uring_init(struct uring *u, unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) {
+        return -1;
+    }
+    u->entries = p.sq_entries;
+
+    u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // newer kernels share one mapping for both rings
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_map_size > u->sq_map_size) u->sq_map_size = u->cq_map_size;
+        u->cq_map_size = u->sq_map_size;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_map = u->sq_map;
+    } else {
+        u->cq_map = mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) {
+            munmap(u->sq_map, u->sq_map_size);
+            close(u->fd);
+            return -1;
+        }
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        if (u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_size);
+        munmap(u->sq_map, u->sq_map_size);
+        close(u->fd);
+        return -1;
+    }
+
+    char *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_destroy(struct uring *u) {
+    munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+    if (u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_size);
+    munmap(u->sq_map, u->sq_map_size);
+    close(u->fd);
+}
+
+struct io_uring_sqe *uring_prepare(struct uring *u) {
+    unsigned int tail = *u->sq_tail + u->queued;
+    unsigned int index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->queued++;
+    return sqe;
+}
+
+int uring_submit(struct uring *u) {
+    if (u->queued > 0) {
+        // the kernel may only see the new tail once the entries are written
+        __atomic_store_n(u->sq_tail, *u->sq_tail + u->queued, __ATOMIC_RELEASE);
+        u->pending += u->queued;
+        u->queued = 0;
+    }
+    while (u->pending > 0) {
+        int done = uring_enter(u->fd, u->pending, 0, 0);
+        if (done < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EBUSY) {
+                // room comes back as completions are reaped, with none in flight only time helps
+                if (u->in_flight > 0) return 0;
+                struct timespec pause = { 0, 1000000 };
+                nanosleep(&pause, NULL);
+                continue;
+            }
+            // what was not submitted would be waited for forever
+            return -1;
+        }
+        u->pending -= done;
+        u->in_flight += done;
+    }
+    return 1;
+}
+
+int uring_wait(struct uring *u, struct io_uring_cqe *cqe) {
+    unsigned int head = *u->cq_head;
+    while (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+    *cqe = u->cqes[head & *u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    u->in_flight--;
+    return 0;
+}
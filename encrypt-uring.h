@@ -0,0 +1,45 @@
+#ifndef ENCRYPT_URING_H
+#define ENCRYPT_URING_H
+
+/* Minimal io_uring wrapper on the raw system calls, so no liburing is needed.
+ * Each ring is used by a single thread, which must never have more requests
+ * in flight than the ring has entries.
+ */
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int queued;    // requests prepared but not submitted yet
+    unsigned int pending;   // submitted requests the kernel has not taken yet
+    unsigned int in_flight; // taken by the kernel and not yet returned by uring_wait()
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+};
+
+/* Returns 0 on success and -1 if io_uring is not available. */
+int uring_init(struct uring *u, unsigned int entries);
+void uring_destroy(struct uring *u);
+
+/* Returns a cleared request to fill in, it is sent by the next uring_submit(). */
+struct io_uring_sqe *uring_prepare(struct uring *u);
+/* Hands the prepared requests to the kernel and returns 1. Returns 0 if the
+ * kernel has no room for some of them until completions are taken off the
+ * ring: the caller then reaps one with uring_wait() and calls again, instead
+ * of spinning here. Returns -1 with errno set on any other error from the
+ * kernel, the ring is of no further use then.
+ */
+int uring_submit(struct uring *u);
+
+/* Waits for any request to complete and copies its completion into cqe.
+ * Returns 0, or -1 with errno set if the kernel fails the wait.
+ */
+int uring_wait(struct uring *u, struct io_uring_cqe *cqe);
+
+#endif // ENCRYPT_URING_H